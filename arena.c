@@ -0,0 +1,94 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK 4096
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	/* 16 bytes in: data is aligned to ARENA_ALIGN like malloc's */
+	char data[];
+};
+
+void arena_init(struct arena *a, size_t block)
+{
+	memset(a, 0, sizeof(*a));
+	a->block = block;
+}
+
+/* add a block of at least n bytes and allocate from it */
+void *arena_grow(struct arena *a, size_t n)
+{
+	struct arena_block *b;
+	size_t size;
+
+	size = a->block ? a->block : ARENA_BLOCK;
+	if (a->total > size)
+		size = a->total;	/* double up */
+	if (size < n)
+		size = n;
+	if ((b = malloc(sizeof(*b) + size)) == NULL)
+		return NULL;
+	b->next = a->head;
+	b->size = size;
+	a->head = b;
+	a->total += size;
+	a->ptr = b->data + n;
+	a->end = b->data + size;
+	return b->data;
+}
+
+/*
+ * Free everything allocated. If that took more than one block they are
+ * replaced by a single one as large as all of them together, so a round
+ * like the last one is served without calling malloc again.
+ */
+void arena_reset(struct arena *a)
+{
+	struct arena_block *b, *next;
+	size_t total;
+
+	if (a->head == NULL)
+		return;
+	if (a->head->next != NULL) {
+		total = a->total;
+		for (b = a->head; b; b = next) {
+			next = b->next;
+			free(b);
+		}
+		a->head = NULL;
+		a->total = 0;
+		a->ptr = a->end = NULL;
+		if ((b = malloc(sizeof(*b) + total)) == NULL)
+			return;
+		b->next = NULL;
+		b->size = total;
+		a->head = b;
+		a->total = total;
+	}
+	a->ptr = a->head->data;
+	a->end = a->head->data + a->head->size;
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *b, *next;
+
+	for (b = a->head; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	arena_init(a, a->block);
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t n)
+{
+	char *p;
+
+	if ((p = arena_alloc(a, n + 1)) == NULL)
+		return NULL;
+	memcpy(p, s, n);
+	p[n] = '\0';
+	return p;
+}
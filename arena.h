@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for things that all die at the same time, e.g. one
+ * response and its headers: allocation is a pointer increment, nothing
+ * is freed individually, arena_reset() drops everything at once and
+ * keeps the memory for the next round. A zeroed struct arena is ready
+ * to use.
+ */
+struct arena_block;
+
+struct arena {
+	struct arena_block *head;	/* block allocated from, older follow */
+	char *ptr, *end;		/* free part of head */
+	size_t total;			/* bytes in all blocks */
+	size_t block;			/* size of the next block, 0: default */
+};
+
+#define ARENA_ALIGN 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void arena_init(struct arena *a, size_t block);
+void *arena_grow(struct arena *a, size_t n);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+char *arena_strndup(struct arena *a, const char *s, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* n bytes aligned to ARENA_ALIGN, NULL if out of memory */
+static inline void *arena_alloc(struct arena *a, size_t n)
+{
+	void *p;
+
+	n = (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (n > (size_t) (a->end - a->ptr))
+		return arena_grow(a, n);
+	p = a->ptr;
+	a->ptr += n;
+	return p;
+}
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * bench_map - fill a header table with a typical response's headers,
+ * look up the ones the client acts on, and throw it away again; once
+ * with the binary search tree map.c used to be and once with the flat
+ * table, for responses of 10, 20 and 30 headers.
+ *
+ * usage: bench_map [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "map.h"
+
+static const char *headers[][2] = {
+	{ "server", "nginx/1.25.3" },
+	{ "date", "Thu, 15 Oct 2026 10:00:00 GMT" },
+	{ "content-type", "text/html; charset=utf-8" },
+	{ "content-length", "48213" },
+	{ "connection", "keep-alive" },
+	{ "cache-control", "private, max-age=0, must-revalidate" },
+	{ "etag", "\"5f2b8c1e-bc55\"" },
+	{ "last-modified", "Wed, 14 Oct 2026 08:12:44 GMT" },
+	{ "vary", "Accept-Encoding" },
+	{ "x-request-id", "7d9e3b2a-41c6-4f0e-9a8b-2c5d7e1f3a4b" },
+	{ "strict-transport-security", "max-age=63072000" },
+	{ "x-frame-options", "SAMEORIGIN" },
+	{ "x-content-type-options", "nosniff" },
+	{ "referrer-policy", "strict-origin-when-cross-origin" },
+	{ "accept-ranges", "bytes" },
+	{ "age", "112" },
+	{ "expires", "Thu, 15 Oct 2026 11:00:00 GMT" },
+	{ "x-cache", "HIT" },
+	{ "x-served-by", "cache-fra-etou8220049-FRA" },
+	{ "x-timer", "S1697364000.123456,VS0,VE0" },
+	{ "content-security-policy", "default-src 'self'" },
+	{ "permissions-policy", "interest-cohort=()" },
+	{ "cross-origin-opener-policy", "same-origin" },
+	{ "cross-origin-resource-policy", "same-origin" },
+	{ "alt-svc", "h3=\":443\"; ma=86400" },
+	{ "via", "1.1 varnish" },
+	{ "x-cache-hits", "3" },
+	{ "nel", "{\"report_to\":\"default\",\"max_age\":2592000}" },
+	{ "report-to", "{\"group\":\"default\",\"max_age\":2592000}" },
+	{ "server-timing", "cdn-cache; desc=HIT, edge; dur=1" },
+};
+
+/* map.c before the flat table: one node and two strings per header */
+struct tree {
+	char *key, *val;
+	struct tree *left, *right;
+};
+
+static void tree_insert(struct tree **t, const char *key, const char *val)
+{
+	int sign;
+
+	while (*t && (sign = strcmp(key, (*t)->key)) != 0)
+		t = sign < 0 ? &(*t)->left : &(*t)->right;
+	if (*t) {
+		free((*t)->val);
+		(*t)->val = strdup(val);
+		return;
+	}
+	*t = malloc(sizeof(**t));
+	(*t)->key = strdup(key);
+	(*t)->val = strdup(val);
+	(*t)->left = (*t)->right = NULL;
+}
+
+static const char *tree_at(struct tree *t, const char *key)
+{
+	int sign;
+
+	while (t && (sign = strcmp(key, t->key)) != 0)
+		t = sign < 0 ? t->left : t->right;
+	return t ? t->val : NULL;
+}
+
+static void tree_free(struct tree *t)
+{
+	if (t) {
+		tree_free(t->left);
+		tree_free(t->right);
+		free(t->key);
+		free(t->val);
+		free(t);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* what the client looks at once the headers are in */
+static size_t round_tree(int n)
+{
+	struct tree *t = NULL;
+	const char *p;
+	size_t sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		tree_insert(&t, headers[i][0], headers[i][1]);
+	if ((p = tree_at(t, "transfer-encoding")) != NULL)
+		sum += strlen(p);
+	if ((p = tree_at(t, "content-length")) != NULL)
+		sum += atoi(p);
+	if ((p = tree_at(t, "connection")) != NULL)
+		sum += strlen(p);
+	tree_free(t);
+	return sum;
+}
+
+static size_t round_flat(int n, struct arena *a, int by_id)
+{
+	struct map map;
+	const char *p;
+	size_t sum = 0;
+	int i;
+
+	arena_reset(a);
+	map_init(&map, a);
+	for (i = 0; i < n; i++)
+		map_insert(&map, headers[i][0], strlen(headers[i][0]),
+			   headers[i][1], strlen(headers[i][1]));
+	p = by_id ? map_get(&map, H_TRANSFER_ENCODING) :
+		map_at(&map, "transfer-encoding");
+	if (p)
+		sum += strlen(p);
+	p = by_id ? map_get(&map, H_CONTENT_LENGTH) :
+		map_at(&map, "content-length");
+	if (p)
+		sum += atoi(p);
+	p = by_id ? map_get(&map, H_CONNECTION) : map_at(&map, "connection");
+	if (p)
+		sum += strlen(p);
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 10, 20, 30 };
+	struct arena arena = { 0 };
+	double t, tree, name, id;
+	int rounds, i, r, n;
+	size_t sum = 0;
+
+	rounds = argc > 1 ? atoi(argv[1]) : 200000;
+	printf("%-8s %12s %12s %12s %8s\n", "headers", "tree ns",
+	       "flat ns", "flat-id ns", "speedup");
+	for (i = 0; i < 3; i++) {
+		n = sizes[i];
+		t = now();
+		for (r = 0; r < rounds; r++)
+			sum += round_tree(n);
+		tree = (now() - t) / rounds * 1e9;
+		t = now();
+		for (r = 0; r < rounds; r++)
+			sum += round_flat(n, &arena, 0);
+		name = (now() - t) / rounds * 1e9;
+		t = now();
+		for (r = 0; r < rounds; r++)
+			sum += round_flat(n, &arena, 1);
+		id = (now() - t) / rounds * 1e9;
+		printf("%-8d %12.1f %12.1f %12.1f %7.2fx\n", n, tree, name, id,
+		       tree / id);
+	}
+	arena_free(&arena);
+	return sum == 0;
+}
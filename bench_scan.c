@@ -0,0 +1,136 @@
+/*
+ * bench_scan - split a large header block into lines and find the colon
+ * of each, the way the response parsers do, once with the old byte at a
+ * time loops and once with each scan kernel the CPU supports.
+ *
+ * usage: bench_scan [megabytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scan.h"
+
+#define MAXLINE 2048
+
+static const char *sample[] = {
+	"HTTP/1.1 200 OK",
+	"Server: nginx/1.25.3",
+	"Date: Thu, 15 Oct 2026 10:00:00 GMT",
+	"Content-Type: text/html; charset=utf-8",
+	"Content-Length: 48213",
+	"Connection: keep-alive",
+	"Cache-Control: private, max-age=0, must-revalidate",
+	"ETag: \"5f2b8c1e-bc55\"",
+	"Set-Cookie: session=3c1f0a9e7b2d4c6a8e0f1b3d5c7a9e1f; Path=/; "
+		"HttpOnly; Secure; SameSite=Lax",
+	"Strict-Transport-Security: max-age=63072000; includeSubDomains",
+	"Content-Security-Policy: default-src 'self'; script-src 'self' "
+		"https://cdn.example.com; img-src * data:",
+	"X-Request-Id: 7d9e3b2a-41c6-4f0e-9a8b-2c5d7e1f3a4b",
+	"Vary: Accept-Encoding",
+};
+#define NSAMPLE (sizeof(sample) / sizeof(sample[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *make_block(size_t size)
+{
+	char *buf, *p;
+	size_t i, n;
+
+	p = buf = malloc(size);
+	for (i = 0; ; i++) {
+		n = strlen(sample[i % NSAMPLE]);
+		if (p + n + 2 > buf + size)
+			break;
+		memcpy(p, sample[i % NSAMPLE], n);
+		p += n;
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	memset(p, '\n', buf + size - p);
+	return buf;
+}
+
+/* what pump() and flush_headers() did before the scan kernels */
+static size_t lines_bytewise(const char *p, const char *end)
+{
+	char line[MAXLINE];
+	size_t i = 0, sum = 0, c;
+
+	for (; p < end; p++) {
+		if (*p == '\n') {
+			line[i] = '\0';
+			for (c = 0; line[c] && line[c] != ':'; c++)
+				;
+			sum += c;
+			i = 0;
+		} else if (*p != '\r') {
+			line[i++] = *p;
+		}
+	}
+	return sum;
+}
+
+static size_t lines_scan(const char *p, const char *end)
+{
+	char line[MAXLINE];
+	const char *eol;
+	size_t n, sum = 0;
+
+	for (; p < end; p = eol + 1) {
+		eol = scan_eol(p, end);
+		n = eol - p;
+		if (n > 0 && p[n - 1] == '\r')
+			n--;
+		memcpy(line, p, n);
+		sum += scan_delim(line, line + n) - line;
+		if (eol == end)
+			break;
+	}
+	return sum;
+}
+
+static double run(size_t (*fn)(const char *, const char *), const char *buf,
+		  size_t size, int rounds, size_t *sum)
+{
+	double t;
+	int i;
+
+	t = now();
+	for (i = 0; i < rounds; i++)
+		*sum += fn(buf, buf + size);
+	t = now() - t;
+	return (double) size * rounds / t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size, sum = 0;
+	double base, mbs;
+	int level, got, rounds = 20;
+	char *buf;
+
+	size = (argc > 1 ? atoi(argv[1]) : 4) << 20;
+	buf = make_block(size);
+
+	base = run(lines_bytewise, buf, size, rounds, &sum);
+	printf("%-10s %10.1f MB/s\n", "bytewise", base);
+	for (level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+		if ((got = scan_select(level)) != level)
+			continue;
+		mbs = run(lines_scan, buf, size, rounds, &sum);
+		printf("%-10s %10.1f MB/s  %5.2fx\n", scan_name(got), mbs,
+		       mbs / base);
+	}
+	free(buf);
+	return sum == 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * Open file cache: a bounded LRU of open fds keyed by the normalized
+ * request path, so a hit costs neither the path walk of open(2) nor a
+ * stat. Entries are dropped as soon as inotify reports the file was
+ * changed, moved or removed. Entries are reference counted: one evicted
+ * while a connection is still sending it is closed by the last
+ * fcache_put().
+ *
+ * A cached entry may carry the rendered response of the hot content cache,
+ * which is dropped along with it.
+ *
+ * Without fcache_init() (the fork model) every fcache_get() opens the
+ * file afresh and fcache_put() closes it again.
+ */
+#include "fcache.h"
+#include "rcache.h"
+#include "http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+static struct fcache_entry **buckets;
+static unsigned nbuckets;		/* power of two */
+static int maxentries, nentries;
+static struct fcache_entry lru = { .prev = &lru, .next = &lru };
+static int ifd = -1;
+
+static unsigned hash_path(const char *s)
+{
+	unsigned h = 2166136261u;	/* FNV-1a */
+
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+/* nentries is the maximum number of cached files; returns -1 on error */
+int fcache_init(int n)
+{
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd == -1)
+		return -1;
+	for (nbuckets = 1; nbuckets < 2 * n; nbuckets <<= 1)
+		;
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (buckets == NULL) {
+		close(ifd);
+		ifd = -1;
+		return -1;
+	}
+	maxentries = n;
+	return 0;
+}
+
+/* inotify fd to poll for readability, -1 if the cache is disabled */
+int fcache_watchfd(void)
+{
+	return ifd;
+}
+
+static void lru_unlink(struct fcache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push(struct fcache_entry *e)
+{
+	e->next = lru.next;
+	e->prev = &lru;
+	lru.next->prev = e;
+	lru.next = e;
+}
+
+/* is wd the watch of a cached entry? hard links share one */
+static int watch_in_use(int wd)
+{
+	struct fcache_entry *x;
+
+	for (x = lru.next; x != &lru && x->wd != wd; x = x->next)
+		;
+	return x != &lru;
+}
+
+/* take e out of the cache, keeping it alive for its current users */
+static void uncache(struct fcache_entry *e, int rmwatch)
+{
+	struct fcache_entry **pp;
+
+	for (pp = &buckets[e->hash & (nbuckets - 1)]; *pp != e;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = e->hnext;
+	lru_unlink(e);
+	nentries--;
+
+	/* keep a watch another entry still uses */
+	if (rmwatch && !watch_in_use(e->wd))
+		inotify_rm_watch(ifd, e->wd);
+	e->wd = -1;
+	rcache_drop(e);
+	fcache_put(e);
+}
+
+static struct fcache_entry *file_open(const char *path)
+{
+	struct fcache_entry *e;
+	char full[FCACHE_PATHMAX + 4];
+	struct stat st;
+	struct tm tm;
+
+	if (snprintf(full, sizeof(full), "www/%s", path) >= sizeof(full))
+		return NULL;
+	if ((e = malloc(sizeof(*e))) == NULL)
+		return NULL;
+	e->fd = open(full, O_RDONLY | O_CLOEXEC);
+	if (e->fd == -1) {
+		if (errno != ENOENT)
+			syslog(LOG_ERR, "open %s: %m", full);
+		free(e);
+		return NULL;
+	}
+	/* watch before fstat so no change after the fstat goes unnoticed */
+	e->wd = -1;
+	if (buckets)
+		e->wd = inotify_add_watch(ifd, full, WATCH_MASK);
+	if (fstat(e->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		/* not cached, e.g. a directory: its watch would leak */
+		if (e->wd != -1 && !watch_in_use(e->wd))
+			inotify_rm_watch(ifd, e->wd);
+		close(e->fd);
+		free(e);
+		return NULL;
+	}
+	strcpy(e->path, path);
+	e->hash = hash_path(path);
+	e->size = st.st_size;
+	e->mtime = st.st_mtime;
+	snprintf(e->etag, sizeof(e->etag), "ETag: \"%lx-%llx-%lx\"\r\n",
+		 (unsigned long) st.st_ino, (unsigned long long) st.st_size,
+		 (unsigned long) st.st_mtime);
+	gmtime_r(&st.st_mtime, &tm);
+	strftime(e->last_modified, sizeof(e->last_modified),
+		 "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+	e->content_type = http_content_type(path);
+	e->refs = 1;
+	e->resp = NULL;
+	e->hnext = NULL;
+	e->prev = e->next = e;
+	return e;
+}
+
+/*
+ * Return the open file for path (normalized, relative to www/) with a
+ * reference the caller must drop with fcache_put(), or NULL if there is
+ * no such regular file.
+ */
+struct fcache_entry *fcache_get(const char *path)
+{
+	struct fcache_entry *e;
+	unsigned h;
+
+	if (strlen(path) >= FCACHE_PATHMAX)
+		return NULL;
+	if (buckets) {
+		h = hash_path(path);
+		for (e = buckets[h & (nbuckets - 1)]; e; e = e->hnext) {
+			if (e->hash == h && strcmp(e->path, path) == 0) {
+				lru_unlink(e);
+				lru_push(e);
+				e->refs++;
+				return e;
+			}
+		}
+	}
+
+	if ((e = file_open(path)) == NULL || e->wd == -1)
+		return e;	/* cache disabled or the file can't be watched */
+	if (nentries == maxentries)
+		uncache(lru.prev, 1);
+	e->hnext = buckets[e->hash & (nbuckets - 1)];
+	buckets[e->hash & (nbuckets - 1)] = e;
+	lru_push(e);
+	nentries++;
+	e->refs++;
+	return e;
+}
+
+void fcache_put(struct fcache_entry *e)
+{
+	if (--e->refs == 0) {
+		close(e->fd);
+		free(e);
+	}
+}
+
+/* drop the entries of every file inotify reports as changed */
+void fcache_invalidate(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct fcache_entry *e, *next;
+	ssize_t n;
+	char *p;
+
+	while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			for (e = lru.next; e != &lru; e = next) {
+				next = e->next;
+				if (e->wd == ev->wd)
+					uncache(e, !(ev->mask & IN_IGNORED));
+			}
+		}
+	}
+}
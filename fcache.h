@@ -0,0 +1,42 @@
+#ifndef FCACHE_H
+#define FCACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#define FCACHE_PATHMAX 256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rcache_entry;
+
+/* an open file under www/ plus the metadata its response header needs */
+struct fcache_entry {
+	char path[FCACHE_PATHMAX];	/* normalized, relative to www/ */
+	unsigned hash;
+	int fd;
+	off_t size;
+	time_t mtime;
+	char etag[64];			/* "ETag: ...\r\n" */
+	char last_modified[48];		/* "Last-Modified: ...\r\n" */
+	const char *content_type;	/* "Content-Type: ...\r\n" */
+	int refs;	/* connections using the entry, +1 while cached */
+	int wd;		/* inotify watch, -1 if not cached */
+	struct rcache_entry *resp;	/* rendered response, if any */
+	struct fcache_entry *hnext;		/* hash chain */
+	struct fcache_entry *prev, *next;	/* LRU list, newest first */
+};
+
+int fcache_init(int nentries);
+struct fcache_entry *fcache_get(const char *path);
+void fcache_put(struct fcache_entry *e);
+int fcache_watchfd(void);
+void fcache_invalidate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
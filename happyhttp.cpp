@@ -25,29 +25,48 @@
  */
 
 #include "happyhttp.h"
+#include "scan.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>	// for gethostbyname() but we should use getaddrinfo instead
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
 
 #include <cerrno>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
 #include <cstdarg>
+#include <cstdint>
 
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <charconv>
 #include <iostream>
+#include <new>
 
 using namespace std;
 
 namespace happyhttp
 {
+	// Bodies are handed to ResponseData_CB in pieces of up to this
+	// much. Everything received is used before the next recv(), so
+	// one buffer per connection, or per reactor, does.
+	static const size_t RECVBUF_SIZE = 64 * 1024;
+
+	// Bodies at least this big, and of known length, are spliced to the
+	// sink, through a pipe made this big if the system lets us (the
+	// default is 64KB).
+	static const int SPLICE_MIN = 16 * 1024;
+	static const int SINK_PIPE_SIZE = 1024 * 1024;
+
 	static void err_exit(const char *fmt, ...)
 	{
 		va_list ap;
@@ -63,25 +82,269 @@ namespace happyhttp
 		exit(EXIT_FAILURE);
 	}
 
-// return true if socket has data waiting to be read
-	bool datawaiting(int sockfd)
+// return true if socket has data waiting to be read within timeout ms
+// (-1 waits for as long as it takes)
+	bool datawaiting(int sockfd, int timeout)
 	{
-		fd_set rset;
-		int flag;
+		struct pollfd pfd;
+		int nready;
 
-		flag = fcntl(sockfd, F_GETFL, 0);
-		fcntl(sockfd, F_SETFL, flag | O_NONBLOCK);
-		FD_ZERO(&rset);
-		FD_SET(sockfd, &rset);
-
-		int nready = select(sockfd + 1, &rset, NULL, NULL, NULL);
+		pfd.fd = sockfd;
+		pfd.events = POLLIN;
+		while ((nready = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+			;
 		if (nready == -1)
-			err_exit("select");
+			err_exit("poll: %s\n", strerror(errno));
+		return nready > 0;
+	}
 
-		if(FD_ISSET(sockfd, &rset))
-			return true;
-		else
-			return false;
+	static long now_ms()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+	}
+
+	static void set_nonblock(int fd, bool on)
+	{
+		int flags = fcntl(fd, F_GETFL, 0);
+
+		fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+	}
+
+	// Connect a new socket to addr. With nonblock the handshake is left
+	// to finish in the background. -1 with errno set on failure.
+	static int open_connect(const struct sockaddr *addr, socklen_t addrlen,
+				bool nonblock)
+	{
+		int fd, err;
+
+		fd = socket(addr->sa_family,
+			    SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+		if (fd == -1)
+			return -1;
+		if (connect(fd, addr, addrlen) == 0 ||
+		    (nonblock && errno == EINPROGRESS))
+			return fd;
+		err = errno;
+		::close(fd);
+		errno = err;
+		return -1;
+	}
+
+	// Look up host and connect to the first address that takes it,
+	// which is copied to addr if that isn't NULL. The lookup itself
+	// always blocks.
+	static int resolve_connect(const char *host, int port,
+				   struct sockaddr_storage *addr, socklen_t *addrlen,
+				   bool nonblock)
+	{
+		struct addrinfo hints, *res, *pres;
+		char service[16];
+		int fd = -1, err;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = 0;
+		snprintf(service, sizeof(service), "%d", port);
+
+		if ((err = getaddrinfo(host, service, &hints, &res)) != 0) {
+			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+			errno = EHOSTUNREACH;
+			return -1;
+		}
+		
+		for (pres = res; pres; pres = pres->ai_next)
+			if ((fd = open_connect(pres->ai_addr, pres->ai_addrlen,
+					       nonblock)) != -1)
+				break;
+		if (pres == NULL) {
+			err = errno;
+			freeaddrinfo(res);
+			errno = err;
+			return -1;
+		}
+		if (addr) {
+			memcpy(addr, pres->ai_addr, pres->ai_addrlen);
+			*addrlen = pres->ai_addrlen;
+		}
+		freeaddrinfo(res);
+		return fd;
+	}
+
+	void* ArenaResource::do_allocate(size_t bytes, size_t align)
+	{
+		char *p;
+
+		if (align <= ARENA_ALIGN) {
+			p = (char *) arena_alloc(&m_Arena, bytes);
+		} else {
+			p = (char *) arena_alloc(&m_Arena, bytes + align);
+			if (p)
+				p += align - (uintptr_t) p % align;
+		}
+		if (p == NULL)
+			throw std::bad_alloc();
+		return p;
+	}
+
+//---------------------------------------------------------------------
+//
+// ConnectionPool
+//
+//---------------------------------------------------------------------
+	static time_t monotonic_now()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec;
+	}
+
+	// An idle keep-alive socket should have nothing to read. If it has,
+	// the server closed it (or sent something we can't make sense of).
+	static bool sock_usable(int fd)
+	{
+		struct pollfd pfd;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		return poll(&pfd, 1, 0) == 0;
+	}
+
+	void pool_init(ConnectionPool *pool, int maxperhost, int idletimeout)
+	{
+		pool->m_Hosts.clear();
+		pool->m_MaxPerHost = maxperhost;
+		pool->m_IdleTimeout = idletimeout;
+	}
+
+	void pool_destroy(ConnectionPool *pool)
+	{
+		for (auto& h : pool->m_Hosts) {
+			assert(h.second.m_Busy == 0 && h.second.m_Waiting.empty());
+			for (const PoolEntry& e : h.second.m_Idle)
+				::close(e.m_Sock);
+		}
+		pool->m_Hosts.clear();
+	}
+
+	void pool_evict(ConnectionPool *pool)
+	{
+		time_t now = monotonic_now();
+
+		for (auto& h : pool->m_Hosts) {
+			std::vector<PoolEntry>& idle = h.second.m_Idle;
+			size_t n = 0;
+
+			while (n < idle.size() &&
+			       now - idle[n].m_Since >= pool->m_IdleTimeout)
+				::close(idle[n++].m_Sock);
+			idle.erase(idle.begin(), idle.begin() + n);
+		}
+	}
+
+	static void watch(Connection *conn);
+	static void unwatch(Connection *conn);
+	static void flush_out(Connection *conn);
+	static void lost(Connection *conn, int err);
+	static void body_data(Response *resp, const unsigned char *data, int n);
+
+	// Give conn a socket to its host, an idle one if there is one.
+	// -1 with errno set if there is none to be had, 1 if m_MaxPerHost
+	// sockets are in use: conn then waits on the host's queue until
+	// pool_wake() lets it try again.
+	static int pool_connect(Connection *conn)
+	{
+		bool nonblock = conn->m_Reactor != NULL;
+		ConnectionPool *pool = conn->m_Pool;
+		std::string key = conn->m_Host + ":" + std::to_string(conn->m_Port);
+		auto it = pool->m_Hosts.find(key);
+		PoolHost *h;
+		int fd;
+
+		if (it == pool->m_Hosts.end()) {
+			h = &pool->m_Hosts[key];
+			h->m_Busy = 0;
+			h->m_AddrLen = 0;
+		} else {
+			h = &it->second;
+		}
+		pool_evict(pool);
+		conn->m_PoolHost = h;
+
+		while (!h->m_Idle.empty()) {
+			fd = h->m_Idle.back().m_Sock;
+			h->m_Idle.pop_back();
+			if (sock_usable(fd)) {
+				set_nonblock(fd, nonblock);
+				conn->m_Sock = fd;
+				h->m_Busy++;
+				return 0;
+			}
+			::close(fd);
+		}
+
+		if (h->m_Busy >= pool->m_MaxPerHost) {
+			if (!conn->m_PoolWait) {
+				h->m_Waiting.push_back(conn);
+				conn->m_PoolWait = true;
+			}
+			return 1;
+		}
+		fd = -1;
+		if (h->m_AddrLen > 0)	// if it moved, look it up again
+			fd = open_connect((struct sockaddr *) &h->m_Addr,
+					  h->m_AddrLen, nonblock);
+		if (fd == -1)
+			fd = resolve_connect(conn->m_Host.c_str(), conn->m_Port,
+					     &h->m_Addr, &h->m_AddrLen, nonblock);
+		if (fd == -1)
+			return -1;
+		conn->m_Sock = fd;
+		h->m_Busy++;
+		return 0;
+	}
+
+	static void pool_unwait(Connection *conn)
+	{
+		std::deque<Connection*>& q = conn->m_PoolHost->m_Waiting;
+
+		q.erase(std::find(q.begin(), q.end(), conn));
+		conn->m_PoolWait = false;
+	}
+
+	// A socket to h was handed back or closed: the first connection
+	// waiting for one gets it. One on a reactor connects right away, a
+	// blocking one on its next pump().
+	static void pool_wake(PoolHost *h)
+	{
+		Connection *conn;
+
+		if (h->m_Waiting.empty())
+			return;
+		conn = h->m_Waiting.front();
+		h->m_Waiting.pop_front();
+		conn->m_PoolWait = false;
+		if (conn->m_Reactor)
+			tcp_connect(conn);
+	}
+
+	// conn is done with its socket, keep it for the next request
+	static void pool_release(Connection *conn)
+	{
+		PoolHost *h = conn->m_PoolHost;
+
+		pool_evict(conn->m_Pool);
+		if (conn->m_Reactor)
+			unwatch(conn);
+		h->m_Busy--;
+		h->m_Idle.push_back({ conn->m_Sock, monotonic_now() });
+		conn->m_Sock = -1;
+		conn->m_Answered = 0;
+		pool_wake(h);
 	}
 
 //---------------------------------------------------------------------
@@ -89,6 +352,20 @@ namespace happyhttp
 // Connection
 //
 //---------------------------------------------------------------------
+	// done with the oldest outstanding response
+	static void pop_response(Connection *conn)
+	{
+		Response *r = conn->m_Outstanding.front();
+
+		conn->m_Outstanding.pop_front();
+		if (conn->m_Sent > 0)
+			conn->m_Sent--;
+		ArenaResource *a = r->m_Arena;
+		r->~Response();		// its memory goes with the arena
+		arena_reset(&a->m_Arena);
+		conn->m_Arenas.emplace_back(a);
+	}
+
 	void connection_init(Connection *conn, const char *host, int port)
 	{
 		conn->m_ResponseBeginCB = NULL;
@@ -99,11 +376,37 @@ namespace happyhttp
 		conn->m_Host = host;
 		conn->m_Port = port;
 		conn->m_Sock = -1;
+		conn->m_Pool = NULL;
+		conn->m_PoolHost = NULL;
+		conn->m_PoolWait = false;
+		conn->m_Reactor = NULL;
+		conn->m_Events = 0;
+		conn->m_Connecting = false;
+		conn->m_Timeout = 0;
+		conn->m_Depth = 0;
+		conn->m_Sent = 0;
+		conn->m_SentOff = 0;
+		conn->m_Answered = 0;
+		conn->m_Sink = -1;
+		conn->m_SinkPipe[0] = conn->m_SinkPipe[1] = -1;
+		conn->m_SinkPipeSize = 0;
+		conn->m_Trace = stdout;
+	}
+
+	static void sink_nosplice(Connection *conn)
+	{
+		if (conn->m_SinkPipe[0] != -1) {
+			::close(conn->m_SinkPipe[0]);
+			::close(conn->m_SinkPipe[1]);
+			conn->m_SinkPipe[0] = conn->m_SinkPipe[1] = -1;
+		}
 	}
 
 	void connection_destroy(Connection *conn)
 	{
 		close(conn);
+		conn->m_RecvBuf.reset();
+		sink_nosplice(conn);
 	}
 	
 	void setcallbacks(Connection *conn, ResponseBegin_CB begincb,
@@ -115,100 +418,417 @@ namespace happyhttp
 		conn->m_ResponseCompleteCB = completecb;
 		conn->m_UserData = userdata;
 	}
+
+	void setpool(Connection *conn, ConnectionPool *pool)
+	{
+		assert(conn->m_Sock < 0);
+		conn->m_Pool = pool;
+	}
+
+	void settimeout(Connection *conn, int timeout)
+	{
+		conn->m_Timeout = timeout;
+	}
+
+	void setpipeline(Connection *conn, int depth)
+	{
+		conn->m_Depth = depth;
+	}
+
+	void settrace(Connection *conn, FILE *fp)
+	{
+		conn->m_Trace = fp;
+	}
+
+	void setsink(Connection *conn, int fd)
+	{
+		conn->m_Sink = fd;
+		if (fd < 0 || conn->m_SinkPipe[0] != -1)
+			return;
+		if (pipe2(conn->m_SinkPipe, O_CLOEXEC) == -1) {
+			conn->m_SinkPipe[0] = conn->m_SinkPipe[1] = -1;
+			return;		// bodies are written to it then
+		}
+		fcntl(conn->m_SinkPipe[1], F_SETPIPE_SZ, SINK_PIPE_SIZE);
+		conn->m_SinkPipeSize = fcntl(conn->m_SinkPipe[1], F_GETPIPE_SZ);
+	}
 	
-	// any requests still outstanding?
-	bool outstanding(Connection *conn) 
+	bool outstanding(Connection *conn)
 	{
 		return !conn->m_Outstanding.empty();
 	}
-	
-	void pump(Connection *conn)
+
+	// close the socket and forget about it, or stop waiting for one
+	static void drop_sock(Connection *conn)
 	{
-		if (conn->m_Outstanding.empty())
-			return;		// no requests outstanding
+		bool pooled = conn->m_Sock >= 0 && conn->m_Pool;
+
+		if (conn->m_PoolWait)
+			pool_unwait(conn);
+		if (pooled)
+			conn->m_PoolHost->m_Busy--;
+		::close(conn->m_Sock);
+		conn->m_Sock = -1;
+		conn->m_Events = 0;
+		conn->m_Connecting = false;
+		conn->m_Answered = 0;
+		if (pooled)
+			pool_wake(conn->m_PoolHost);
+	}
 
+	// Give up on the socket and on the responses outstanding on it,
+	// which complete with error err. Requests that their callbacks
+	// issue are left alone.
+	static void fail(Connection *conn, int err)
+	{
+		size_t n = conn->m_Outstanding.size();
 		Response *r;
-		assert(conn->m_Sock > 0); // outstanding requests but no connection!
 
-		if (!datawaiting(conn->m_Sock))
-			return;				// recv will block
+		drop_sock(conn);
+		conn->m_Sent = 0;
+		conn->m_SentOff = 0;
+		while (n-- > 0) {
+			r = conn->m_Outstanding.front();
+			r->m_Error = err;
+			Finish(r);
+			pop_response(conn);
+		}
+	}
 
-		unsigned char buf[2048];
-		ssize_t n = recv(conn->m_Sock, buf, sizeof(buf), 0);
+	// r is complete, take it off the connection. false if that was the
+	// end of the connection as well.
+	static bool retire(Connection *conn, Response *r)
+	{
+		bool willclose = r->m_WillClose;
+
+		pop_response(conn);
+		conn->m_Answered++;
+		if (willclose) {
+			// the server is done with this socket, it ignores
+			// the rest
+			lost(conn, ECONNRESET);
+			return false;
+		}
+		return true;
+	}
+
+	// after a read: if nothing is left to wait for, the socket can be
+	// reused, else the pipeline may have room
+	static void settle(Connection *conn)
+	{
+		if (conn->m_Pool && conn->m_Outstanding.empty() &&
+		    conn->m_State == IDLE)
+			pool_release(conn);
+		else if (conn->m_Reactor)
+			flush_out(conn);
+	}
 
-		if (n < 0)
-			err_exit("recv error: %s\n", strerror(errno));
+	// hand what recv() got to the outstanding responses, n == 0 means
+	// the server closed the connection
+	static void process(Connection *conn, const unsigned char *buf, ssize_t n)
+	{
+		Response *r;
 
 		if (n == 0) {
 			// connection has closed
-			r = conn->m_Outstanding.front();
-			notifyconnectionclosed(r);
-			assert(completed(r));
-			delete r;
-			conn->m_Outstanding.pop_front();
-
-			// any outstanding requests will be discarded
-			close(conn);
+			lost(conn, ECONNRESET);
 		} else {
 			int used = 0;
 			while (used < n && !conn->m_Outstanding.empty()) {
 				r = conn->m_Outstanding.front();
 				int u = pump(r, buf + used, n - used);
 
-				// delete response once completed
-				
-				if (completed(r)) {
-					delete r;
-					conn->m_Outstanding.pop_front();
-				}
 				used += u;
+				// delete response once completed
+				if (completed(r) && !retire(conn, r))
+					return;
 			}
 
 			// NOTE: will lose bytes if response queue goes empty
 			// (but server shouldn't be sending anything if we don't have
 			// anything outstanding anyway)
 			assert(used == n);	// all bytes should be used up by here.
+			settle(conn);
 		}
 	}
-	
-	void tcp_connect(Connection *conn)
+
+	// Move n body bytes that sink_splice() put in m_SinkPipe on to the
+	// sink. If that can't be done with splice(), they are read back and
+	// written, and if it is because the sink doesn't take splice() at
+	// all, the pipe isn't used again.
+	static void sink_drain(Connection *conn, Response *r,
+			       unsigned char *buf, ssize_t n)
 	{
-		struct addrinfo hints, *res, *pres;
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = 0;
+		ssize_t m;
+		int err;
+
+		while (n > 0) {
+			m = splice(conn->m_SinkPipe[0], NULL, conn->m_Sink, NULL,
+				   n, SPLICE_F_MOVE);
+			if (m > 0) {
+				n -= m;
+				continue;
+			}
+			if (m == -1 && errno == EINTR)
+				continue;
+			err = m == 0 ? EIO : errno;
+			while (n > 0) {
+				m = read(conn->m_SinkPipe[0], buf,
+					 std::min<size_t>(n, RECVBUF_SIZE));
+				if (m <= 0)
+					err_exit("sink pipe: %s\n", strerror(errno));
+				body_data(r, buf, m);
+				n -= m;
+			}
+			if (err == EINVAL)
+				sink_nosplice(conn);
+		}
+	}
 
-		if (getaddrinfo(conn->m_Host.c_str(), "http", &hints, &res) != 0) {
-			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(h_errno));
-			exit(EXIT_FAILURE);
+	// Splice what has arrived of the body r is reading from the socket
+	// to the sink, when that is worth it. Returns the number of bytes
+	// moved, 0 if the server closed the connection, -1 with errno set if
+	// splice() failed, or -2 if the body is to be received as usual.
+	static ssize_t sink_splice(Connection *conn, Response *r,
+				   unsigned char *buf)
+	{
+		ssize_t n;
+
+		if (conn->m_Sink < 0 || conn->m_SinkPipe[0] == -1 ||
+		    r->m_State != BODY || r->m_Chunked || r->m_Length == -1 ||
+		    r->m_Error || r->m_Length - r->m_BytesRead < SPLICE_MIN)
+			return -2;
+		n = splice(conn->m_Sock, NULL, conn->m_SinkPipe[1], NULL,
+			   std::min<size_t>(r->m_Length - r->m_BytesRead,
+					    conn->m_SinkPipeSize),
+			   SPLICE_F_MOVE);
+		if (n <= 0)
+			return n;
+		sink_drain(conn, r, buf, n);
+		r->m_BytesRead += n;
+		if (r->m_BytesRead == r->m_Length) {
+			Finish(r);
+			if (retire(conn, r))
+				settle(conn);
 		}
-		
-		for (pres = res; pres; pres = pres->ai_next) {
-			conn->m_Sock = socket(pres->ai_family, pres->ai_socktype,
-				pres->ai_protocol);
+		return n;
+	}
+
+	// Read whatever the socket has for the outstanding responses into
+	// buf, or straight into the sink, and hand it on. -1 with errno set
+	// if that failed.
+	static int receive(Connection *conn, unsigned char *buf)
+	{
+		ssize_t n = -2;
+
+		if (!conn->m_Outstanding.empty())
+			n = sink_splice(conn, conn->m_Outstanding.front(), buf);
+		if (n == -2)
+			n = recv(conn->m_Sock, buf, RECVBUF_SIZE, 0);
+		else if (n > 0)
+			return 0;
+		if (n == -1)
+			return -1;
+		process(conn, buf, n);
+		return 0;
+	}
+
+	static bool idempotent(const char *method)
+	{
+		static const char *const methods[] = {
+			"GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE",
+		};
+
+		for (const char *m : methods)
+			if (!strcmp(method, m))
+				return true;
+		return false;
+	}
+
+	// Requests the socket may take now: complete (not still between
+	// putrequest() and endheaders()) and within the pipeline depth.
+	static size_t sendable(Connection *conn)
+	{
+		size_t n = conn->m_Outstanding.size();
+
+		if (conn->m_State == REQ_STARTED)
+			n--;
+		if (conn->m_Depth > 0 && n > (size_t) conn->m_Depth)
+			n = conn->m_Depth;
+		return n;
+	}
+
+	// Write out the requests sendable() allows, as many at a time as one
+	// sendmsg() takes. -1 with errno set if the socket fails, or would
+	// block if it is non-blocking.
+	static int write_requests(Connection *conn)
+	{
+		struct iovec iov[64];
+		struct msghdr msg;
+		size_t i, n, off, left, limit;
+		ssize_t sent;
+		Response *r;
+
+		for (;;) {
+			limit = sendable(conn);
+			off = conn->m_SentOff;
+			for (i = conn->m_Sent, n = 0; i < limit && n < 64; i++) {
+				r = conn->m_Outstanding[i];
+				iov[n].iov_base = r->m_Request.data() + off;
+				iov[n++].iov_len = r->m_Request.size() - off;
+				off = 0;
+			}
+			if (n == 0)
+				return 0;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = n;
+			if ((sent = sendmsg(conn->m_Sock, &msg, MSG_NOSIGNAL)) == -1) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			while (sent > 0) {
+				r = conn->m_Outstanding[conn->m_Sent];
+				left = r->m_Request.size() - conn->m_SentOff;
+				if ((size_t) sent < left) {
+					conn->m_SentOff += sent;
+					break;
+				}
+				sent -= left;
+				conn->m_Sent++;
+				conn->m_SentOff = 0;
+			}
+		}
+	}
+
+	// The socket is gone, err says why. A response that ends with the
+	// connection ends, one that was cut short fails. The requests that
+	// got no answer are sent again on a new connection if that is safe:
+	// all of them that went out were idempotent, and the old connection
+	// answered something or the first of them hasn't been sent twice
+	// already. If not, they all fail.
+	static void lost(Connection *conn, int err)
+	{
+		bool answered = conn->m_Answered > 0;
+		size_t i, sent;
+		Response *r;
+
+		drop_sock(conn);
+		if (conn->m_Outstanding.empty())
+			return;
+		r = conn->m_Outstanding.front();
+		if (r->m_State != STATUSLINE || !r->m_LineBuf.empty()) {
+			notifyconnectionclosed(r);
+			assert(completed(r));
+			pop_response(conn);
+			answered = true;
+			if (conn->m_Outstanding.empty())
+				return;
+		}
+
+		sent = conn->m_Sent + (conn->m_SentOff > 0);
+		r = conn->m_Outstanding.front();
+		if (sent > 0 && !answered && r->m_Replayed) {
+			fail(conn, err);
+			return;
+		}
+		for (i = 0; i < sent; i++) {
+			if (!conn->m_Outstanding[i]->m_Idempotent) {
+				fail(conn, err);
+				return;
+			}
+		}
+		if (sent > 0 && !answered)
+			r->m_Replayed = true;
+		conn->m_Sent = 0;
+		conn->m_SentOff = 0;
+		tcp_connect(conn);
+	}
+
+	void pump(Connection *conn)
+	{
+		if (conn->m_Reactor) {
+			reactor_run(conn->m_Reactor, -1);
+			return;
+		}
+		if (conn->m_Outstanding.empty())
+			return;		// no requests outstanding
+
+		if (conn->m_Sock < 0)
+			tcp_connect(conn);
+		if (conn->m_Sock < 0)
+			return;		// waiting for the pool, try again
+		if (write_requests(conn) == -1) {
+			lost(conn, errno);
+			return;
+		}
+
+		Response *r = conn->m_Outstanding.front();
+		assert(conn->m_Sock > 0); // outstanding requests but no connection!
+
+		int wait = -1;
+		if (r->m_Deadline)
+			wait = std::max(r->m_Deadline - now_ms(), 0L);
+		if (!datawaiting(conn->m_Sock, wait)) {
+			fail(conn, ETIMEDOUT);
+			return;
+		}
+
+		if (!conn->m_RecvBuf)
+			conn->m_RecvBuf.reset(new unsigned char[RECVBUF_SIZE]);
+		if (receive(conn, conn->m_RecvBuf.get()) == -1)
+			lost(conn, errno);
+	}
+	
+	// -1 with errno set if there is no connection to be had, 1 if
+	// conn waits for the pool to have one
+	static int open_sock(Connection *conn)
+	{
+		bool nonblock = conn->m_Reactor != NULL;
+		int ret;
+
+		if (conn->m_Pool) {
+			if ((ret = pool_connect(conn)) != 0)
+				return ret;
+		} else {
+			conn->m_Sock = resolve_connect(conn->m_Host.c_str(),
+						       conn->m_Port, NULL, NULL,
+						       nonblock);
 			if (conn->m_Sock == -1)
-				continue;
-			if (connect(conn->m_Sock, pres->ai_addr, pres->ai_addrlen) == 0)
-				break;
-			::close(conn->m_Sock);
+				return -1;
 		}
-		if (pres == NULL) {
-			fprintf(stderr, "connect error: %s\n", strerror(errno));
-			exit(EXIT_FAILURE);
+		// a fresh non-blocking socket may still be connecting, and
+		// a pooled one is writable right away anyway
+		conn->m_Connecting = nonblock;
+		return 0;
+	}
+
+	void tcp_connect(Connection *conn)
+	{
+		int ret = open_sock(conn);
+
+		if (ret == 0) {
+			if (conn->m_Reactor)
+				watch(conn);
+		} else if (ret == 1) {
+			;	// pool_wake() connects it, or pump() retries
+		} else if (conn->m_Reactor) {
+			fail(conn, errno);
+		} else {
+			err_exit("%s:%d: %s\n", conn->m_Host.c_str(), conn->m_Port,
+				 strerror(errno));
 		}
-		freeaddrinfo(res);
 	}
 
 	void close(Connection *conn)
 	{
-		::close(conn->m_Sock);
-		conn->m_Sock = -1;
+		drop_sock(conn);
+		conn->m_Sent = 0;
+		conn->m_SentOff = 0;
 		// discard any incomplete responses
-		while (!conn->m_Outstanding.empty()) {
-			delete conn->m_Outstanding.front();
-			conn->m_Outstanding.pop_front();
-		}
+		while (!conn->m_Outstanding.empty())
+			pop_response(conn);
 	}
 
 
@@ -253,53 +873,73 @@ namespace happyhttp
 		if(conn->m_State != IDLE)
 			err_exit("Request already issued");
 		
-		char req[512];
-		
+		// Push a new response onto the queue, in a spare arena
+		std::unique_ptr<ArenaResource> a;
+		if (conn->m_Arenas.empty()) {
+			a = std::make_unique<ArenaResource>();
+		} else {
+			a = std::move(conn->m_Arenas.back());
+			conn->m_Arenas.pop_back();
+		}
+		void *mem = a->allocate(sizeof(Response), alignof(Response));
+		Response *r = new (mem) Response(a.get());
+		response_init(r, method, conn);
+		r->m_Arena = a.release();
+		r->m_Idempotent = idempotent(method);
+		if (conn->m_Timeout > 0)
+			r->m_Deadline = now_ms() + conn->m_Timeout;
+		conn->m_Outstanding.push_back(r);
+
 		conn->m_State = REQ_STARTED;
-		
-		sprintf(req, "%s %s HTTP/1.1", method, url);
-		conn->m_Buffer.push_back(req);
+
+		// The request is written straight into the arena, where it
+		// stays until it is answered. Room for the usual headers.
+		size_t mlen = strlen(method), ulen = strlen(url);
+		std::pmr::string& req = r->m_Request;
+		req.reserve(mlen + ulen + conn->m_Host.size() + 256);
+		req.append(method, mlen).append(1, ' ').append(url, ulen);
+		req.append(" HTTP/1.1\r\n");
 		
 		//required for HTTP1.1
 		putheader(conn, "Host", conn->m_Host.c_str());	
 
 		// don't want any fancy encodings please
 		putheader(conn, "Accept-Encoding", "identity");
-
-		// Push a new response onto the queue
-		Response *r = new Response;
-		response_init(r, method, conn);
-		conn->m_Outstanding.push_back(r);
 	}
 	
 	void putheader(Connection *conn, const char* header, const char* value)
 	{
 		if (conn->m_State != REQ_STARTED)
 			err_exit("putheader() failed");
-		conn->m_Buffer.push_back(string(header) + ": " + value);
+		std::pmr::string& req = conn->m_Outstanding.back()->m_Request;
+		req.append(header).append(": ", 2).append(value);
+		req.append("\r\n", 2);
 	}
 
 	void putheader(Connection *conn, const char* header, int numericvalue)
 	{
-		char buf[32];
-		sprintf(buf, "%d", numericvalue);
+		char buf[16];
+		char *end = std::to_chars(buf, buf + sizeof(buf) - 1,
+					  numericvalue).ptr;
+
+		*end = '\0';
 		putheader(conn, header, buf);
 	}
 
+	// The request is queued with its response, and goes out with those
+	// before and after it on the next pump() (or when the reactor finds
+	// the socket writable), within the pipeline depth.
 	void endheaders(Connection *conn)
 	{
 		if (conn->m_State != REQ_STARTED)
 			err_exit("Cannot send header");
 		conn->m_State = IDLE;
 
-		conn->m_Buffer.push_back("");
-
-		string msg;
-		for (auto it = conn->m_Buffer.begin(); it != conn->m_Buffer.end(); ++it)
-			msg += (*it) + "\r\n";
-
-		conn->m_Buffer.clear();
-		send(conn, msg.c_str(), msg.size());
+		conn->m_Outstanding.back()->m_Request.append("\r\n", 2);
+		if (conn->m_Sock < 0)
+			tcp_connect(conn);
+		else if (conn->m_Reactor)
+			watch(conn);
 	}
 
 	void send(Connection *conn, const char* buf, int buflen)
@@ -307,6 +947,22 @@ namespace happyhttp
 		ssize_t nsent;
 		if (conn->m_Sock < 0)
 			tcp_connect(conn);
+		if (conn->m_Sock < 0 && !conn->m_PoolWait)
+			return;		// the reactor failed it, and said so
+
+		// the body of the last request, it goes out with that
+		if (!conn->m_Outstanding.empty() && conn->m_State == IDLE) {
+			Response *r = conn->m_Outstanding.back();
+
+			if (conn->m_Sent == conn->m_Outstanding.size()) {
+				conn->m_Sent--;		// already went, send the rest
+				conn->m_SentOff = r->m_Request.size();
+			}
+			r->m_Request.append(buf, buflen);
+			if (conn->m_Reactor && conn->m_Sock >= 0)
+				watch(conn);
+			return;
+		}
 
 		while (buflen > 0) {
 			nsent = ::send(conn->m_Sock, buf, buflen, 0);
@@ -317,6 +973,154 @@ namespace happyhttp
 		}
 	}
 
+//---------------------------------------------------------------------
+//
+// Reactor
+//
+//---------------------------------------------------------------------
+	// keep the epoll registration in line with what conn waits for
+	static void watch(Connection *conn)
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		if (conn->m_Connecting || conn->m_Sent < sendable(conn))
+			ev.events |= EPOLLOUT;
+		if (ev.events == conn->m_Events)
+			return;
+		ev.data.ptr = conn;
+		epoll_ctl(conn->m_Reactor->m_Epoll,
+			  conn->m_Events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+			  conn->m_Sock, &ev);
+		conn->m_Events = ev.events;
+	}
+
+	// before the socket leaves conn without being closed
+	static void unwatch(Connection *conn)
+	{
+		if (conn->m_Events)
+			epoll_ctl(conn->m_Reactor->m_Epoll, EPOLL_CTL_DEL,
+				  conn->m_Sock, NULL);
+		conn->m_Events = 0;
+	}
+
+	// write what requests the socket takes
+	static void flush_out(Connection *conn)
+	{
+		if (conn->m_Sock < 0 || conn->m_Connecting)
+			return;
+		if (write_requests(conn) == -1 && errno != EAGAIN) {
+			lost(conn, errno);
+			return;
+		}
+		watch(conn);
+	}
+
+	static void reactor_event(Connection *conn, unsigned events)
+	{
+		int sock = conn->m_Sock;
+		socklen_t len;
+		int err;
+
+		if (conn->m_Connecting) {
+			if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+				return;
+			len = sizeof(err);
+			if (getsockopt(conn->m_Sock, SOL_SOCKET, SO_ERROR,
+				       &err, &len) == -1)
+				err = errno;
+			if (err) {
+				fail(conn, err);
+				return;
+			}
+			conn->m_Connecting = false;
+		}
+		if (events & EPOLLOUT) {
+			flush_out(conn);
+			if (conn->m_Sock != sock)
+				return;		// lost, the events were for that
+		}
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			if (receive(conn, conn->m_Reactor->m_RecvBuf.get()) == -1 &&
+			    errno != EAGAIN && errno != EINTR)
+				lost(conn, errno);
+		}
+	}
+
+	void reactor_init(Reactor *rx)
+	{
+		if ((rx->m_Epoll = epoll_create1(EPOLL_CLOEXEC)) == -1)
+			err_exit("epoll_create1: %s\n", strerror(errno));
+		rx->m_Conns.clear();
+		rx->m_RecvBuf.reset(new unsigned char[RECVBUF_SIZE]);
+	}
+
+	void reactor_destroy(Reactor *rx)
+	{
+		while (!rx->m_Conns.empty())
+			reactor_remove(rx, rx->m_Conns.back());
+		::close(rx->m_Epoll);
+		rx->m_RecvBuf.reset();
+	}
+
+	void reactor_add(Reactor *rx, Connection *conn)
+	{
+		assert(conn->m_Sock < 0 && conn->m_Reactor == NULL);
+		conn->m_Reactor = rx;
+		rx->m_Conns.push_back(conn);
+	}
+
+	void reactor_remove(Reactor *rx, Connection *conn)
+	{
+		auto it = std::find(rx->m_Conns.begin(), rx->m_Conns.end(), conn);
+
+		if (it == rx->m_Conns.end())
+			return;
+		*it = rx->m_Conns.back();
+		rx->m_Conns.pop_back();
+		close(conn);
+		conn->m_Reactor = NULL;
+	}
+
+	int reactor_run(Reactor *rx, int timeout)
+	{
+		struct epoll_event events[64];
+		long now = now_ms(), deadline;
+		int i, n, busy;
+
+		// don't sleep past the earliest deadline
+		for (Connection *conn : rx->m_Conns) {
+			if (conn->m_Outstanding.empty())
+				continue;
+			deadline = conn->m_Outstanding.front()->m_Deadline;
+			if (deadline && (timeout < 0 || deadline - now < timeout))
+				timeout = std::max(deadline - now, 0L);
+		}
+
+		n = epoll_wait(rx->m_Epoll, events, 64, timeout);
+		if (n == -1 && errno != EINTR)
+			err_exit("epoll_wait: %s\n", strerror(errno));
+		for (i = 0; i < n; i++)
+			reactor_event((Connection *) events[i].data.ptr,
+				      events[i].events);
+
+		now = now_ms();
+		busy = 0;
+		// by index, callbacks may add connections
+		for (size_t j = 0; j < rx->m_Conns.size(); j++) {
+			Connection *conn = rx->m_Conns[j];
+
+			if (conn->m_Outstanding.empty())
+				continue;
+			deadline = conn->m_Outstanding.front()->m_Deadline;
+			if (deadline && now >= deadline)
+				fail(conn, ETIMEDOUT);
+			if (!conn->m_Outstanding.empty())
+				busy++;
+		}
+		return busy;
+	}
+
 //---------------------------------------------------------------------
 //
 // Response
@@ -327,7 +1131,7 @@ namespace happyhttp
 		return resp->m_State == COMPLETE;
 	}
 
-	const std::string& get_http_version(const Response *resp)
+	const std::pmr::string& get_http_version(const Response *resp)
 	{
 		return resp->m_VersionString;
 	}
@@ -350,23 +1154,42 @@ namespace happyhttp
 		resp->m_ChunkLeft = 0;
 		resp->m_Length = -1;
 		resp->m_WillClose = false;
+		resp->m_Error = 0;
+		resp->m_Deadline = 0;
+		resp->m_Idempotent = false;
+		resp->m_Replayed = false;
 	}
 
-	const char* getheader(const Response *resp, const char* name)
+	const char* getheader(const Response *resp, HeaderId id)
 	{
-		std::string lname(name);
-		size_t i;
-
-		for (i = 0; i < lname.size(); i++)
-			lname[i] = tolower(lname[i]);
+		return id == HDR_OTHER ? NULL : resp->m_Known[id];
+	}
 
-		auto it = resp->m_Headers.find(lname);
+	const char* getheader(const Response *resp, const char* name)
+	{
+		char lname[128];
+		size_t i, n = strlen(name);
+		HeaderId id = header_id(name, n);
+
+		if (id != HDR_OTHER)
+			return resp->m_Known[id];
+		if (n > sizeof(lname))
+			return NULL;	// we never stored such a name
+		for (i = 0; i < n; i++)
+			lname[i] = tolower(name[i]);
+
+		auto it = resp->m_Headers.find(std::string_view(lname, n));
 		if (it == resp->m_Headers.end())
 			return NULL;
 		else
 			return it->second.c_str();
 	}
 
+	int geterror(const Response *resp)
+	{
+		return resp->m_Error;
+	}
+
 	int getstatus(const Response *resp) 
 	{
 		// only valid once we've got the statusline
@@ -388,26 +1211,28 @@ namespace happyhttp
 			return;
 
 		// eof can be valid...
-		if (resp->m_State == BODY && !resp->m_Chunked && resp->m_Length == -1)
+		if (resp->m_State == BODY && !resp->m_Chunked && resp->m_Length == -1) {
 			Finish(resp);	// we're all done!
-		else
-			err_exit("Connection closed unexpectedly");
+		} else {
+			resp->m_Error = ECONNRESET;	// cut short
+			Finish(resp);
+		}
 	}
 
-	void process_whole_line(Response *resp)
+	void process_whole_line(Response *resp, std::string_view line)
 	{
 		switch (resp->m_State) {
 		case STATUSLINE:
-			ProcessStatusLine(resp);
+			ProcessStatusLine(resp, line);
 			break;
 		case HEADERS:
-			ProcessHeaderLine(resp);
+			ProcessHeaderLine(resp, line);
 			break;
 		case TRAILERS:
-			ProcessTrailerLine(resp);
+			ProcessTrailerLine(resp, line);
 			break;
 		case CHUNKLEN:
-			ProcessChunkLenLine(resp);
+			ProcessChunkLenLine(resp, line);
 			break;
 		case CHUNKEND:
 			// just soak up the CRLF after body and go to next state
@@ -419,26 +1244,51 @@ namespace happyhttp
 		}
 	}
 	
+	// Copy the header being read out of the data pump() was given, which
+	// the caller reuses, or out of m_LineBuf.
+	static void keep_header(Response *resp)
+	{
+		if (resp->m_HeaderPend.data() != resp->m_HeaderAccum.data()) {
+			resp->m_HeaderAccum.assign(resp->m_HeaderPend);
+			resp->m_HeaderPend = resp->m_HeaderAccum;
+		}
+	}
+
 	int pump(Response *resp, const unsigned char* data, int datasize)
 	{
 		assert(datasize != 0);
 		int count = datasize;
-		char c;
 		
 		while (count > 0 && resp->m_State != COMPLETE)	{
 			if (resp->m_State != BODY) {
-				// we want to accumulate a line
-				while(count-- > 0) {
-					c = *data++;
-					if(c == '\n') {
-						// now got a whole line!
-						process_whole_line(resp);
-						resp->m_LineBuf.clear();
-						break;	// break out of line accumulation!
-					} else {
-						if(c != '\r')	// just ignore CR
-							resp->m_LineBuf += c;
-					}
+				// Lines are used where they are, only one that
+				// the data ends in the middle of is copied.
+				const char *p = (const char *) data;
+				const char *eol = scan_eol(p, p + count);
+				std::string_view line;
+				bool copied = !resp->m_LineBuf.empty();
+
+				if (eol == p + count) {
+					resp->m_LineBuf.append(p, count);
+					count = 0;	// rest of line in next read
+					break;
+				}
+				if (copied) {
+					resp->m_LineBuf.append(p, eol - p);
+					line = resp->m_LineBuf;
+				} else {
+					line = std::string_view(p, eol - p);
+				}
+				data += eol + 1 - p;
+				count -= eol + 1 - p;
+
+				// now got a whole line! just ignore CR
+				if (!line.empty() && line.back() == '\r')
+					line.remove_suffix(1);
+				process_whole_line(resp, line);
+				if (copied) {
+					keep_header(resp);
+					resp->m_LineBuf.clear();
 				}
 			} else {
 				int bytesused = 0;
@@ -451,24 +1301,50 @@ namespace happyhttp
 				count -= bytesused;
 			}
 		}
+		keep_header(resp);
 		// return number of bytes used
 		return datasize - count;
 	}
 
-	void ProcessChunkLenLine(Response *resp)
+	void ProcessChunkLenLine(Response *resp, std::string_view line)
 	{
 		// chunklen in hex at beginning of line
-		resp->m_ChunkLeft = strtol(resp->m_LineBuf.c_str(), NULL, 16);
+		resp->m_ChunkLeft = 0;
+		std::from_chars(line.data(), line.data() + line.size(),
+				resp->m_ChunkLeft, 16);
 	
 		if (resp->m_ChunkLeft == 0) {
 			// got the whole body, now check for trailing headers
 			resp->m_State = TRAILERS;
-			resp->m_HeaderAccum.clear();
+			resp->m_HeaderPend = {};
 		} else {
 			resp->m_State = BODY;
 		}
 	}
 
+	// pass body data out, to the sink or the data callback
+	static void body_data(Response *resp, const unsigned char *data, int n)
+	{
+		Connection *conn = resp->m_Connection;
+		ssize_t w;
+
+		if (conn->m_Sink < 0) {
+			if (conn->m_ResponseDataCB)
+				(conn->m_ResponseDataCB)(resp, conn->m_UserData,
+							 data, n);
+			return;
+		}
+		while (n > 0 && !resp->m_Error) {
+			if ((w = write(conn->m_Sink, data, n)) == -1) {
+				if (errno != EINTR)
+					resp->m_Error = errno;
+				continue;
+			}
+			data += w;
+			n -= w;
+		}
+	}
+
 // handle some body data in chunked mode
 // returns number of bytes used.
 	int ProcessDataChunked(Response *resp, const unsigned char* data, int count)
@@ -479,9 +1355,7 @@ namespace happyhttp
 		if (n > resp->m_ChunkLeft)
 			n = resp->m_ChunkLeft;
 
-		// invoke callback to pass out the data
-		if (resp->m_Connection->m_ResponseDataCB)
-			(resp->m_Connection->m_ResponseDataCB)(resp, resp->m_Connection->m_UserData, data, n );
+		body_data(resp, data, n);
 
 		resp->m_BytesRead += n;
 		resp->m_ChunkLeft -= n;
@@ -506,10 +1380,7 @@ namespace happyhttp
 				n = remaining;
 		}
 
-		// invoke callback to pass out the data
-		if(resp->m_Connection->m_ResponseDataCB)
-			(resp->m_Connection->m_ResponseDataCB)(resp, resp->m_Connection->m_UserData,
-							data, n);
+		body_data(resp, data, n);
 
 		resp->m_BytesRead += n;
 
@@ -528,32 +1399,33 @@ namespace happyhttp
 							     resp->m_Connection->m_UserData);
 	}
 
-	void ProcessStatusLine(Response *resp)
+	void ProcessStatusLine(Response *resp, std::string_view line)
 	{
-		const char* p = resp->m_LineBuf.c_str();
+		const char* p = line.data();
+		const char* end = p + line.size();
+		const char* q;
 
 		// skip any leading space
-		while(*p && isspace(*p))
+		while (p < end && isspace(*p))
 			++p;
 		// get version
-		while(*p && !isspace(*p))
-			resp->m_VersionString += *p++;
-		while(*p && isspace(*++p))
+		q = scan_delim(p, end);
+		resp->m_VersionString.assign(p, q);
+		for (p = q; p < end && isspace(*p); ++p)
 			;
 		// get status code
-		std::string status;
-		while(*p && !isspace(*p))
-			status += *p++;
-		while (*p && isspace(*++p))
+		q = scan_delim(p, end);
+		std::string status(p, q);
+		for (p = q; p < end && isspace(*p); ++p)
 			;
 		// rest of line is reason
-		while (*p)
-			resp->m_Reason += *p++;
+		resp->m_Reason.assign(p, end);
 
 		resp->m_Status = atoi(status.c_str());
 
 		if(resp->m_Status < 100 || resp->m_Status > 999) /* really happend ?*/
-			err_exit("BadStatusLine (%s)", resp->m_LineBuf.c_str()); 
+			err_exit("BadStatusLine (%.*s)", (int) line.size(),
+				 line.data());
 
 		if (!resp->m_VersionString.compare(0, 8, "HTTP/1.0"))
 			resp->m_Version = 10;
@@ -564,36 +1436,61 @@ namespace happyhttp
 	
 		// OK, now we expect headers!
 		resp->m_State = HEADERS;
-		resp->m_HeaderAccum.clear();
+		resp->m_HeaderPend = {};
 	}
 
 // process accumulated header data
 	void FlushHeader(Response *resp)
 	{
-		if(resp->m_HeaderAccum.empty())
+		if(resp->m_HeaderPend.empty())
 			return;	// no flushing required
 
-		const char* p = resp->m_HeaderAccum.c_str();
-
-		std::string header, value;
-		while(*p && *p != ':')
-			header += tolower(*p++);
+		const char* p = resp->m_HeaderPend.data();
+		const char* end = p + resp->m_HeaderPend.size();
+		const char* colon = scan_delim(p, end);
+		HeaderId id = header_id(p, colon - p);
+		const char* name = p;
 
 		// skip ':'
 		// skip space
-		while(*p && isspace(*++p))
+		for (p = colon; p < end && isspace(*p); ++p)
 			;
-		value = p; // rest of line is value
-		resp->m_Headers[header] = value;
-		printf("%s: %s\n", header.c_str(), value.c_str());
+		if (p < end && *p == ':')
+			++p;
+		while (p < end && isspace(*p))
+			++p;
+		// rest of line is value
+		if (id != HDR_OTHER) {
+			std::pmr::memory_resource* mr =
+				resp->m_Headers.get_allocator().resource();
+			char* value = (char*) mr->allocate(end - p + 1, 1);
+
+			memcpy(value, p, end - p);
+			value[end - p] = '\0';
+			resp->m_Known[id] = value;
+			if (resp->m_Connection->m_Trace)
+				fprintf(resp->m_Connection->m_Trace, "%s: %s\n",
+					header_names[id].data(), value);
+		} else {
+			std::pmr::string header(name, colon,
+					resp->m_Headers.get_allocator());
+			for (size_t i = 0; i < header.size(); i++)
+				header[i] = tolower(header[i]);
+			auto it = resp->m_Headers.insert_or_assign(std::move(header),
+					std::pmr::string(p, end,
+						resp->m_Headers.get_allocator())).first;
+			if (resp->m_Connection->m_Trace)
+				fprintf(resp->m_Connection->m_Trace, "%s: %s\n",
+					it->first.c_str(), it->second.c_str());
+		}
 
+		resp->m_HeaderPend = {};
 		resp->m_HeaderAccum.clear();
 	}
 
-	void ProcessHeaderLine(Response *resp)
+	void ProcessHeaderLine(Response *resp, std::string_view line)
 	{
-		const char* p = resp->m_LineBuf.c_str();
-		if (resp->m_LineBuf.empty()) {
+		if (line.empty()) {
 			FlushHeader(resp);
 			// end of headers
 
@@ -605,25 +1502,29 @@ namespace happyhttp
 			return;
 		}
 
-		if (isspace(*p)) {
-			// it's a continuation line - just add it to previous data
-			while(*p && isspace(*++p))
-				;
+		if (isspace(line[0])) {
+			// it's a continuation line - just add it to previous
+			// data, which has to be copied for that
+			size_t i = 1;
+			while (i < line.size() && isspace(line[i]))
+				i++;
 
+			keep_header(resp);
 			resp->m_HeaderAccum += ' ';
-			resp->m_HeaderAccum += p;
+			resp->m_HeaderAccum.append(line.substr(i));
+			resp->m_HeaderPend = resp->m_HeaderAccum;
 		} else {
-			// begin a new header
+			// begin a new header, where it is for now
 			FlushHeader(resp);
-			resp->m_HeaderAccum = p;
+			resp->m_HeaderPend = line;
 		}
 	}
 
-	void ProcessTrailerLine(Response *resp)
+	void ProcessTrailerLine(Response *resp, std::string_view line)
 	{
 		// TODO: handle trailers?
 		// (python httplib doesn't seem to!)
-		if (resp->m_LineBuf.empty())
+		if (line.empty())
 			Finish(resp);
 		// just ignore all the trailers...
 	}
@@ -638,7 +1539,7 @@ namespace happyhttp
 		resp->m_WillClose = false;
 
 		// using chunked encoding?
-		const char* trenc = getheader(resp, "transfer-encoding");
+		const char* trenc = getheader(resp, HDR_TRANSFER_ENCODING);
 		if (trenc != NULL && !strcasecmp(trenc, "chunked")) {
 			resp->m_Chunked = true;
 			resp->m_ChunkLeft = -1;	// unknown
@@ -646,7 +1547,7 @@ namespace happyhttp
 		resp->m_WillClose = CheckClose(resp);
 
 		// length supplied?
-		const char* contentlen = getheader(resp, "content-length");
+		const char* contentlen = getheader(resp, HDR_CONTENT_LENGTH);
 		if(contentlen && !resp->m_Chunked)
 			resp->m_Length = atoi(contentlen);
 	
@@ -672,6 +1573,11 @@ namespace happyhttp
 			resp->m_State = CHUNKLEN;
 		else
 			resp->m_State = BODY;
+
+		// no body at all, don't wait for data that won't come (the next
+		// pipelined response's, or EOF)
+		if (!resp->m_Chunked && resp->m_Length == 0)
+			Finish(resp);
 	}
 
         // return true if we think server will automatically close connectin at end
@@ -680,7 +1586,7 @@ namespace happyhttp
 		if(resp->m_Version == 11) {
 			// HTTP/1.1
 			// the connection stays open unless "connection: close" is specified.
-			const char* connection_hdr = getheader(resp, "connection");
+			const char* connection_hdr = getheader(resp, HDR_CONNECTION);
 			if (connection_hdr && !strcasecmp(connection_hdr, "close"))
 				return true;
 			else
@@ -689,15 +1595,157 @@ namespace happyhttp
 
 		// Older HTTP
 		// keep-alive header indicates persistant connection 
-		if (getheader(resp, "keep-alive"))
+		if (getheader(resp, HDR_KEEP_ALIVE))
 			return false;
 
 		// TODO: some special case handling for Akamai and netscape maybe?
 		// (see _check_close() in python httplib.py for details)
 		return true;
 	}
+
+//---------------------------------------------------------------------
+//
+// Coroutines
+//
+//---------------------------------------------------------------------
+	std::suspend_never Task::promise_type::final_suspend() noexcept
+	{
+		m_Executor->m_Tasks--;
+		return {};
+	}
+
+	void executor_init(Executor *ex, int maxperhost, int idletimeout)
+	{
+		reactor_init(&ex->m_Reactor);
+		pool_init(&ex->m_Pool, maxperhost, idletimeout);
+		ex->m_Ready.clear();
+		ex->m_Tasks = 0;
+	}
+
+	void executor_destroy(Executor *ex)
+	{
+		assert(ex->m_Tasks == 0);
+		reactor_destroy(&ex->m_Reactor);
+		pool_destroy(&ex->m_Pool);
+	}
+
+	void spawn(Executor *ex, Task task)
+	{
+		task.m_Handle.promise().m_Executor = ex;
+		ex->m_Ready.push_back(task.m_Handle);
+		task.m_Handle = nullptr;
+		ex->m_Tasks++;
+	}
+
+	void run(Executor *ex)
+	{
+		std::coroutine_handle<> h;
+
+		while (ex->m_Tasks > 0) {
+			while (!ex->m_Ready.empty()) {
+				h = ex->m_Ready.front();
+				ex->m_Ready.pop_front();
+				h.resume();
+			}
+			if (ex->m_Tasks > 0)
+				reactor_run(&ex->m_Reactor, -1);
+		}
+	}
+
+	// the callbacks only note what happened and queue the coroutine
+	// waiting for it, which resumes once the reactor is done
+	static void wake(Exchange *x)
+	{
+		if (x->m_Waiter) {
+			x->m_Executor->m_Ready.push_back(x->m_Waiter);
+			x->m_Waiter = nullptr;
+		}
+	}
+
+	static void on_begin(const Response *r, void *userdata)
+	{
+		Exchange *x = (Exchange *) userdata;
+
+		x->m_Status = getstatus(r);
+		x->m_Reason = getreason(r);
+		for (int id = 1; id < HDR_COUNT; id++)
+			if (r->m_Known[id])
+				x->m_Headers.emplace(header_names[id], r->m_Known[id]);
+		for (const auto& h : r->m_Headers)
+			x->m_Headers.emplace(h.first, h.second);
+		x->m_Begun = true;
+		wake(x);
+	}
+
+	static void on_data(const Response *r, void *userdata,
+			    const unsigned char *data, int n)
+	{
+		Exchange *x = (Exchange *) userdata;
+
+		x->m_Body.append((const char *) data, n);
+		wake(x);
+	}
+
+	static void on_complete(const Response *r, void *userdata)
+	{
+		Exchange *x = (Exchange *) userdata;
+
+		x->m_Error = geterror(r);
+		x->m_Done = true;
+		wake(x);
+	}
+
+	Exchange::~Exchange()
+	{
+		// closes the socket unless the response is complete and it
+		// went back to the pool
+		reactor_remove(&m_Executor->m_Reactor, &m_Conn);
+	}
+
+	Pending Client::request(const char *method, const char *url,
+				const char *headers[], const unsigned char *body,
+				int bodysize)
+	{
+		auto x = std::make_unique<Exchange>();
+
+		x->m_Executor = m_Executor;
+		x->m_Begun = x->m_Done = false;
+		x->m_Status = x->m_Error = 0;
+		connection_init(&x->m_Conn, m_Host.c_str(), m_Port);
+		setcallbacks(&x->m_Conn, on_begin, on_data, on_complete, x.get());
+		settrace(&x->m_Conn, NULL);
+		setpool(&x->m_Conn, &m_Executor->m_Pool);
+		settimeout(&x->m_Conn, m_Timeout);
+		reactor_add(&m_Executor->m_Reactor, &x->m_Conn);
+		happyhttp::request(&x->m_Conn, method, url, headers, body,
+				   bodysize);
+		return Pending{ std::move(x) };
+	}
+
+	Reply Pending::await_resume()
+	{
+		return Reply{ std::move(m_Ex) };
+	}
+
+	std::string_view BodyRead::await_resume()
+	{
+		m_Ex->m_Chunk.swap(m_Ex->m_Body);
+		m_Ex->m_Body.clear();
+		return m_Ex->m_Chunk;
+	}
+
+	const char* Reply::header(const char* name) const
+	{
+		std::string lname(name);
+
+		for (char& c : lname)
+			c = tolower(c);
+		auto it = m_Ex->m_Headers.find(lname);
+		return it == m_Ex->m_Headers.end() ? NULL : it->second.c_str();
+	}
 }	// end namespace happyhttp
 
+#ifndef HAPPYHTTP_NO_MAIN
 int cnt = 0;
 void OnBegin(const happyhttp::Response *r, void* userdata)
 {
@@ -781,10 +1829,112 @@ void Test3()
 		pump(&conn);
 }
 
+// coroutine version of Test1, also fetching /favicon.ico at the same time
+happyhttp::Task Test4Get(happyhttp::Client *client, int *finished)
+{
+	happyhttp::Pending pending[] = {
+		client->get("/"), client->get("/favicon.ico"),
+	};
+
+	for (auto& p : pending) {
+		happyhttp::Reply r = co_await p;
+		std::string_view piece;
+		size_t n = 0;
+
+		while (!(piece = co_await r.read()).empty())
+			n += piece.size();
+		const char *len = r.header("Content-Length");
+		if (r.status() == 0 || r.error() != 0 ||
+		    (len != NULL && strtoul(len, NULL, 10) != n))
+			happyhttp::err_exit("Test4: status %d, error %d, "
+					    "%zu body bytes of %s\n", r.status(),
+					    r.error(), n, len ? len : "?");
+		printf("%d %s, %zu bytes\n", r.status(), r.reason().c_str(), n);
+	}
+	(*finished)++;
+}
+
+void Test4(const char *host)
+{
+	printf("-----------------Test4------------------------\n" );
+	// more tasks than the pool lets talk to the host at once: the
+	// rest wait for a socket, none of them fails
+	const int ntasks = 5;
+	int finished = 0;
+	happyhttp::Executor ex;
+
+	executor_init(&ex, 2);
+	happyhttp::Client client(&ex, host);
+	for (int i = 0; i < ntasks; i++)
+		spawn(&ex, Test4Get(&client, &finished));
+	run(&ex);
+	executor_destroy(&ex);
+	if (finished != ntasks)
+		happyhttp::err_exit("Test4: %d of %d tasks finished\n",
+				    finished, ntasks);
+}
+
+// Test1 with the body spliced to a file instead of passed to OnData
+struct Test5Result {
+	long length;	// Content-Length, -1 if none
+	int error;
+};
+
+void Test5Begin(const happyhttp::Response *r, void *userdata)
+{
+	Test5Result *res = (Test5Result *) userdata;
+	const char *len = getheader(r, happyhttp::HDR_CONTENT_LENGTH);
+
+	res->length = len ? strtol(len, NULL, 10) : -1;
+}
+
+void Test5Data(const happyhttp::Response *r, void *userdata,
+	       const unsigned char *data, int n)
+{
+	happyhttp::err_exit("Test5: %d body bytes bypassed the sink\n", n);
+}
+
+void Test5Complete(const happyhttp::Response *r, void *userdata)
+{
+	((Test5Result *) userdata)->error = geterror(r);
+}
+
+void Test5(const char *host)
+{
+	printf("-----------------Test5------------------------\n" );
+	Test5Result res = { -1, 0 };
+	struct happyhttp::Connection conn;
+	struct stat st;
+	FILE *fp;
+
+	if ((fp = tmpfile()) == NULL)
+		happyhttp::err_exit("tmpfile: %s\n", strerror(errno));
+	connection_init(&conn, host, 80);
+	setcallbacks(&conn, Test5Begin, Test5Data, Test5Complete, &res);
+	settrace(&conn, NULL);
+	setsink(&conn, fileno(fp));
+
+	request(&conn, "GET", "/", 0, 0, 0);
+
+	while (outstanding(&conn))
+		pump(&conn);
+	connection_destroy(&conn);
+	if (fstat(fileno(fp), &st) == -1)
+		happyhttp::err_exit("fstat: %s\n", strerror(errno));
+	if (res.error != 0 || (res.length >= 0 && st.st_size != res.length))
+		happyhttp::err_exit("Test5: error %d, %ld of %ld body bytes\n",
+				    res.error, (long) st.st_size, res.length);
+	printf("%ld bytes spliced\n", (long) st.st_size);
+	fclose(fp);
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc != 2)
 		happyhttp::err_exit("Usage: a.out <host>\n");
 	Test1(argv[1]);
+	Test4(argv[1]);
+	Test5(argv[1]);
 	return 0;
 }
+#endif	// HAPPYHTTP_NO_MAIN
@@ -28,9 +28,19 @@
 #define HAPPYHTTP_H
 
 #include <string>
+#include <string_view>
 #include <map>
 #include <vector>
 #include <deque>
+#include <memory>
+#include <memory_resource>
+#include <coroutine>
+#include <cstdio>
+
+#include <sys/socket.h>
+#include <time.h>
+
+#include "arena.h"
 
 namespace happyhttp
 {
@@ -102,6 +112,144 @@ namespace happyhttp
 		NOT_EXTENDED = 510,
 	};
 
+//-------------------------------------------------
+// Header names
+//
+// The standard response headers get an id through a perfect hash that
+// is worked out at compile time: a name hashes to one slot, a single
+// compare confirms it, and a response keeps their values in an array
+// indexed by id. Other names go to a general table.
+// ------------------------------------------------
+	enum HeaderId : unsigned char {
+		HDR_OTHER,	// not a well-known name
+		HDR_ACCEPT_RANGES,
+		HDR_AGE,
+		HDR_ALLOW,
+		HDR_CACHE_CONTROL,
+		HDR_CONNECTION,
+		HDR_CONTENT_DISPOSITION,
+		HDR_CONTENT_ENCODING,
+		HDR_CONTENT_LANGUAGE,
+		HDR_CONTENT_LENGTH,
+		HDR_CONTENT_LOCATION,
+		HDR_CONTENT_RANGE,
+		HDR_CONTENT_TYPE,
+		HDR_DATE,
+		HDR_ETAG,
+		HDR_EXPIRES,
+		HDR_KEEP_ALIVE,
+		HDR_LAST_MODIFIED,
+		HDR_LINK,
+		HDR_LOCATION,
+		HDR_PRAGMA,
+		HDR_PROXY_AUTHENTICATE,
+		HDR_RETRY_AFTER,
+		HDR_SERVER,
+		HDR_SET_COOKIE,
+		HDR_STRICT_TRANSPORT_SECURITY,
+		HDR_TRAILER,
+		HDR_TRANSFER_ENCODING,
+		HDR_UPGRADE,
+		HDR_VARY,
+		HDR_VIA,
+		HDR_WWW_AUTHENTICATE,
+		HDR_COUNT
+	};
+
+	// lowercase, in HeaderId order
+	constexpr std::string_view header_names[HDR_COUNT] = {
+		"", "accept-ranges", "age", "allow", "cache-control",
+		"connection", "content-disposition", "content-encoding",
+		"content-language", "content-length", "content-location",
+		"content-range", "content-type", "date", "etag", "expires",
+		"keep-alive", "last-modified", "link", "location", "pragma",
+		"proxy-authenticate", "retry-after", "server", "set-cookie",
+		"strict-transport-security", "trailer", "transfer-encoding",
+		"upgrade", "vary", "via", "www-authenticate",
+	};
+
+	constexpr int HEADER_HASH_BITS = 7;
+
+	// Hash of the length and three of the characters, case folded (names
+	// are tokens, setting bit 5 lowercases the letters), mixed with seed.
+	constexpr unsigned header_hash(const char* s, size_t len, unsigned seed)
+	{
+		unsigned key = (unsigned) len;
+
+		key = key * 31 + (unsigned char) (s[0] | 0x20);
+		key = key * 31 + (unsigned char) (s[len / 2] | 0x20);
+		key = key * 31 + (unsigned char) (s[len - 1] | 0x20);
+		return ((key ^ seed) * 0x9e3779b1u) >> (32 - HEADER_HASH_BITS);
+	}
+
+	// the first seed for which no two names share a slot, ~0 if none
+	constexpr unsigned header_find_seed()
+	{
+		for (unsigned seed = 0; seed < (1u << 16); seed++) {
+			bool used[1 << HEADER_HASH_BITS] = {};
+			int id = 1;
+
+			for (; id < HDR_COUNT; id++) {
+				unsigned h = header_hash(header_names[id].data(),
+							 header_names[id].size(), seed);
+				if (used[h])
+					break;
+				used[h] = true;
+			}
+			if (id == HDR_COUNT)
+				return seed;
+		}
+		return ~0u;
+	}
+
+	constexpr unsigned header_seed = header_find_seed();
+	static_assert(header_seed != ~0u, "no perfect hash for header_names");
+
+	struct HeaderSlots {
+		unsigned char id[1 << HEADER_HASH_BITS];
+	};
+
+	constexpr HeaderSlots header_make_slots()
+	{
+		HeaderSlots t = {};
+
+		for (int id = 1; id < HDR_COUNT; id++)
+			t.id[header_hash(header_names[id].data(),
+					 header_names[id].size(),
+					 header_seed)] = id;
+		return t;
+	}
+
+	constexpr HeaderSlots header_slots = header_make_slots();
+
+	// id of a header name in any case, HDR_OTHER if it isn't well-known
+	constexpr HeaderId header_id(const char* s, size_t len)
+	{
+		if (len == 0)
+			return HDR_OTHER;
+		HeaderId id = HeaderId(header_slots.id[header_hash(s, len,
+								   header_seed)]);
+		std::string_view name = header_names[id];
+		if (name.size() != len)
+			return HDR_OTHER;
+		for (size_t i = 0; i < len; i++) {
+			unsigned char c = s[i];
+			if ((unsigned) (c - 'A') < 26)
+				c |= 0x20;
+			if (c != (unsigned char) name[i])
+				return HDR_OTHER;
+		}
+		return id;
+	}
+
+	constexpr HeaderId header_id(std::string_view name)
+	{
+		return header_id(name.data(), name.size());
+	}
+
+	static_assert(header_id("Transfer-Encoding") == HDR_TRANSFER_ENCODING);
+	static_assert(header_id("x-powered-by") == HDR_OTHER);
+
 //-------------------------------------------------
 // Connection
 //
@@ -109,6 +257,11 @@ namespace happyhttp
 // responses.
 // ------------------------------------------------
 	struct Connection;
+	// Set up conn to talk to host:port, it doesn't connect until there
+	// is a request to send. connection_destroy() closes it.
+	void connection_init(Connection *conn, const char *host, int port);
+	void connection_destroy(Connection *conn);
+
 	// Set up the response handling callbacks. These will be invoked during
 	// calls to pump().
 	// begincb - called when the responses headers have been received
@@ -118,6 +271,37 @@ namespace happyhttp
 	void setcallbacks(Connection *conn,
 			  ResponseBegin_CB begincb, ResponseData_CB datacb,
 			  ResponseComplete_CB completecb, void* userdata);
+
+	// Take sockets from pool and hand them back to it when a response
+	// leaves the connection open, instead of connecting every time.
+	// When the pool's limit for the host is reached, requests wait for
+	// a socket to be handed back. Call before the first request.
+	struct ConnectionPool;
+	void setpool(Connection *conn, ConnectionPool *pool);
+
+	// Give up on a request if its response isn't complete within
+	// timeout ms of issuing it. It then completes with geterror()
+	// returning ETIMEDOUT, and the connection is closed. 0 waits
+	// forever. Applies to requests issued after the call.
+	void settimeout(Connection *conn, int timeout);
+
+	// Write at most depth requests ahead of their responses, 0 for no
+	// limit. Requests beyond that wait for earlier responses to complete.
+	// If the connection is lost, the requests it didn't answer are sent
+	// again on a new one, unless one of those that went out was not
+	// idempotent (a POST, say); then they complete with an error.
+	void setpipeline(Connection *conn, int depth);
+
+	// Write response bodies to fd instead of handing them to the data
+	// callback, -1 to go back to the callback. A body of known length
+	// is spliced from the socket to fd through a pipe, so it is never
+	// copied to user space. If writing to fd fails, geterror() returns
+	// why once the response completes, and the rest of it is dropped.
+	void setsink(Connection *conn, int fd);
+
+	// Print the headers of each response to fp as they come in, NULL
+	// not to. stdout by default.
+	void settrace(Connection *conn, FILE *fp);
 	// ---------------------------
 	// high-level request interface
 	// ---------------------------
@@ -137,9 +321,13 @@ namespace happyhttp
 	// url is only path part: eg  "/index.html"
 	void putrequest(Connection *conn, const char* method, const char* url);
 
-	// Update the connection (non-blocking)
+	// Update the connection. Waits for the next data to arrive, or for
+	// the reactor to do something if the connection is on one.
 	// Just keep calling this regularly to service outstanding requests.
 	void pump(Connection *conn);
+
+	// Are any requests still waiting for their responses?
+	bool outstanding(Connection *conn);
 	
 	// send body data if any.
 	// To be called after endheaders()
@@ -164,6 +352,85 @@ namespace happyhttp
 	void putheader(Connection *conn, const char* header, int numericvalue);
 	
 	enum state { IDLE, REQ_STARTED, REQ_SENT };
+
+//-------------------------------------------------
+// ConnectionPool
+//
+// Keep-alive sockets that are not in use, by host:port, shared by any
+// number of Connections. The most recently used socket is handed out
+// first so the rest can age out.
+// ------------------------------------------------
+	struct PoolEntry {
+		int m_Sock;
+		time_t m_Since;		// idle since (monotonic seconds)
+	};
+
+	struct PoolHost {
+		std::vector<PoolEntry> m_Idle;	// oldest first
+		int m_Busy;			// sockets handed out
+		// connections waiting for m_Busy to drop below the
+		// limit, first come first served
+		std::deque<Connection*> m_Waiting;
+		// address last connected to, so only the first connect
+		// has to look the name up
+		struct sockaddr_storage m_Addr;
+		socklen_t m_AddrLen;		// 0 if not resolved yet
+	};
+
+	struct ConnectionPool {
+		std::map<std::string, PoolHost> m_Hosts;
+		int m_MaxPerHost;	// sockets open to a host, busy or idle
+		int m_IdleTimeout;	// seconds an idle socket is kept
+	};
+
+	void pool_init(ConnectionPool *pool, int maxperhost, int idletimeout);
+	// close all idle sockets, none may still be in use
+	void pool_destroy(ConnectionPool *pool);
+	// close the sockets that have been idle too long
+	void pool_evict(ConnectionPool *pool);
+
+//-------------------------------------------------
+// Reactor
+//
+// Drives any number of Connections from one epoll instance. A
+// connection on a reactor connects without blocking (the name lookup
+// still blocks, a pool only does that once per host), queues what
+// send() is given and writes it out as the socket takes it. The
+// callbacks are invoked from reactor_run(), and must not remove the
+// connection they are called for.
+// ------------------------------------------------
+	struct Reactor {
+		int m_Epoll;
+		std::vector<Connection*> m_Conns;
+		std::unique_ptr<unsigned char[]> m_RecvBuf;	// shared by all
+	};
+
+	void reactor_init(Reactor *rx);
+	// removes (and closes) all connections still on it
+	void reactor_destroy(Reactor *rx);
+	// before the connection's first request
+	void reactor_add(Reactor *rx, Connection *conn);
+	void reactor_remove(Reactor *rx, Connection *conn);
+	// Wait up to timeout ms (-1 for as long as it takes) for something
+	// to happen and deal with it, and time out requests that are due.
+	// Returns the number of connections with requests outstanding.
+	int reactor_run(Reactor *rx, int timeout);
+
+	// Lets std::pmr containers allocate from an arena. Deallocation does
+	// nothing, the memory comes back when the arena is reset.
+	struct ArenaResource : std::pmr::memory_resource {
+		struct arena m_Arena;
+
+		ArenaResource() { arena_init(&m_Arena, 0); }
+		~ArenaResource() { arena_free(&m_Arena); }
+		ArenaResource(const ArenaResource&) = delete;
+		ArenaResource& operator=(const ArenaResource&) = delete;
+	private:
+		void* do_allocate(size_t bytes, size_t align) override;
+		void do_deallocate(void*, size_t, size_t) override {}
+		bool do_is_equal(const std::pmr::memory_resource& other)
+			const noexcept override { return this == &other; }
+	};
 	
 	struct Connection {
 		// doesn't connect immediately
@@ -178,8 +445,29 @@ namespace happyhttp
 		std::string m_Host;
 		int m_Port;
 		int m_Sock;
-		std::vector<std::string> m_Buffer;	// lines of request
+		ConnectionPool *m_Pool;		// or NULL
+		PoolHost *m_PoolHost;		// m_Sock belongs to this, if pooled
+		bool m_PoolWait;		// on m_PoolHost's m_Waiting
+		Reactor *m_Reactor;		// or NULL
+		unsigned m_Events;		// registered with epoll, 0 if not
+		bool m_Connecting;		// non-blocking connect under way
+		int m_Timeout;			// ms per request, 0 if none
+		int m_Depth;			// pipeline depth, 0 if unlimited
+		// the first m_Sent outstanding requests have been written,
+		// and m_SentOff bytes of the next one
+		size_t m_Sent;
+		size_t m_SentOff;
+		int m_Answered;			// responses completed on m_Sock
+		std::unique_ptr<unsigned char[]> m_RecvBuf;	// if not on a reactor
+		int m_Sink;			// fd bodies go to, or -1
+		FILE *m_Trace;			// headers are printed here, or NULL
+		int m_SinkPipe[2];		// to splice() to it, -1 if not
+		size_t m_SinkPipeSize;
 		std::deque<Response*> m_Outstanding;	// responses for outstanding requests
+		// Each outstanding response lives in an arena of its own with
+		// everything it holds. The arena is reset when the response is
+		// done and kept here for a later one.
+		std::vector<std::unique_ptr<ArenaResource>> m_Arenas;
 	};
 
 //-------------------------------------------------
@@ -200,11 +488,11 @@ namespace happyhttp
 	};
 
 	void FlushHeader(Response *resp);
-	void process_whole_line(Response *resp);
-	void ProcessStatusLine(Response *resp);
-	void ProcessHeaderLine(Response *resp);
-	void ProcessTrailerLine(Response *resp);
-	void ProcessChunkLenLine(Response *resp);
+	void process_whole_line(Response *resp, std::string_view line);
+	void ProcessStatusLine(Response *resp, std::string_view line);
+	void ProcessHeaderLine(Response *resp, std::string_view line);
+	void ProcessTrailerLine(Response *resp, std::string_view line);
+	void ProcessChunkLenLine(Response *resp, std::string_view line);
 
 	int ProcessDataChunked(Response *resp, const unsigned char* data, int count);
 	int ProcessDataNonChunked(Response *resp, const unsigned char* data, int count);
@@ -214,6 +502,10 @@ namespace happyhttp
 	void Finish(Response *resp);
 	// retrieve a header (returns 0 if not present)
 	const char* getheader(const Response *resp, const char* name);
+	const char* getheader(const Response *resp, HeaderId id);
+
+	// errno value if the response was cut short, 0 if not
+	int geterror(const Response *resp);
 
 	// get the HTTP status code
 	int getstatus(const Response *resp);
@@ -233,30 +525,172 @@ namespace happyhttp
 	
 	struct Response {
 		// interface used by Connection
-		// only Connection creates Responses.
+		// only Connection creates Responses, each in an arena of its own.
+		explicit Response(std::pmr::memory_resource* mr)
+			: m_Arena(nullptr), m_Method(mr), m_VersionString(mr),
+			  m_Reason(mr), m_Known(), m_Headers(mr), m_Request(mr),
+			  m_LineBuf(mr), m_HeaderAccum(mr) {}
 
 		Connection *m_Connection; // to access callback ptrs
+		ArenaResource *m_Arena;	// holds this and all it has, if
+					// it came from the connection
 
-		std::string m_Method;		// req method: "GET", "POST" etc...
+		std::pmr::string m_Method;	// req method: "GET", "POST" etc...
 
 		// status line
-		std::string m_VersionString;	// HTTP-Version
+		std::pmr::string m_VersionString;	// HTTP-Version
 		int m_Version;			// 10: HTTP/1.0
 		                                // 11: HTTP/1.x (where x>=1)
 		int m_Status;			// Status-Code
-		std::string m_Reason;	        // Reason-Phrase
+		std::pmr::string m_Reason;	// Reason-Phrase
 		enum response_state m_State;
-		// header/value pairs
-		std::map<std::string, std::string> m_Headers;
+		// values of the well-known headers, by id, 0 if not present
+		const char* m_Known[HDR_COUNT];
+		// other header/value pairs, names in lowercase
+		std::pmr::map<std::pmr::string, std::pmr::string, std::less<>>
+			m_Headers;
 
 		int     m_BytesRead;	// body bytes read so far
 		bool	m_Chunked;	// response is chunked?
 		int	m_ChunkLeft;	// bytes left in current chunk
 		int	m_Length;	// -1 if unknown
 		bool	m_WillClose;	// connection will close at response end?
+		int	m_Error;	// see geterror()
+		long	m_Deadline;	// give up at (ms, monotonic), 0 if never
+		std::pmr::string m_Request;	// what we sent for it
+		bool	m_Idempotent;	// request may be sent again
+		bool	m_Replayed;	// and has been, to no avail yet
+
+		std::pmr::string m_LineBuf;	// a line split over reads
+		// the header being read, in the received data or m_HeaderAccum
+		std::string_view m_HeaderPend;
+		std::pmr::string m_HeaderAccum; // copy of it, when it needs one
+	};
+
+//-------------------------------------------------
+// Coroutines
+//
+// An awaitable layer over the callbacks:
+//
+//	Task fetch(Client *c)
+//	{
+//		Reply r = co_await c->get("/index.html");
+//		std::string_view piece;
+//		while (!(piece = co_await r.read()).empty())
+//			...
+//	}
+//
+// get() issues the request right away, so a coroutine overlaps several
+// calls by making them all before awaiting the first. An Executor runs
+// the tasks spawned on it and the reactor and pool their requests go
+// through, all on the calling thread.
+// ------------------------------------------------
+	struct Executor;
+
+	// a coroutine that spawn() starts, it returns nothing
+	struct Task {
+		struct promise_type {
+			Executor *m_Executor = nullptr;
+
+			Task get_return_object()
+			{
+				return Task(std::coroutine_handle<promise_type>::
+					    from_promise(*this));
+			}
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept;
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+
+		explicit Task(std::coroutine_handle<promise_type> h) : m_Handle(h) {}
+		Task(Task&& t) : m_Handle(t.m_Handle) { t.m_Handle = nullptr; }
+		~Task() { if (m_Handle) m_Handle.destroy(); }	// never spawned
+
+		std::coroutine_handle<promise_type> m_Handle;
+	};
+
+	struct Executor {
+		Reactor m_Reactor;
+		ConnectionPool m_Pool;
+		std::deque<std::coroutine_handle<>> m_Ready;	// to resume
+		int m_Tasks;		// spawned and not finished
+	};
+
+	void executor_init(Executor *ex, int maxperhost = 8, int idletimeout = 30);
+	void executor_destroy(Executor *ex);
+	// start task on the next run()
+	void spawn(Executor *ex, Task task);
+	// resume tasks as what they await comes in, until all have finished
+	void run(Executor *ex);
+
+	// one request and what has come in of its response
+	struct Exchange {
+		Connection m_Conn;
+		Executor *m_Executor;
+		std::coroutine_handle<> m_Waiter;	// awaits the next event
+		bool m_Begun;		// status line and headers are in
+		bool m_Done;
+		int m_Status;
+		int m_Error;
+		std::string m_Reason;
+		std::map<std::string, std::string, std::less<>> m_Headers;
+		std::string m_Body;	// arrived and not read yet
+		std::string m_Chunk;	// what the last read() returned
+
+		~Exchange();
+	};
+
+	struct Reply;
+
+	// awaiting it gives the Reply once the headers are in
+	struct Pending {
+		std::unique_ptr<Exchange> m_Ex;
+
+		bool await_ready() const { return m_Ex->m_Begun || m_Ex->m_Done; }
+		void await_suspend(std::coroutine_handle<> h) { m_Ex->m_Waiter = h; }
+		Reply await_resume();
+	};
+
+	// awaiting it gives the next piece of the body, empty at the end
+	struct BodyRead {
+		Exchange *m_Ex;
+
+		bool await_ready() const { return !m_Ex->m_Body.empty() || m_Ex->m_Done; }
+		void await_suspend(std::coroutine_handle<> h) { m_Ex->m_Waiter = h; }
+		std::string_view await_resume();
+	};
+
+	struct Reply {
+		std::unique_ptr<Exchange> m_Ex;
+
+		// 0 if there was no status line, see error()
+		int status() const { return m_Ex->m_Status; }
+		const std::string& reason() const { return m_Ex->m_Reason; }
+		// errno value if the request failed or was cut short
+		int error() const { return m_Ex->m_Error; }
+		// name in any case, NULL if not present
+		const char* header(const char* name) const;
+		// valid until the next read()
+		BodyRead read() { return BodyRead{ m_Ex.get() }; }
+	};
+
+	// issues requests to one host through an executor
+	struct Client {
+		Executor *m_Executor;
+		std::string m_Host;
+		int m_Port;
+		int m_Timeout;		// ms per request, 0 if none
+
+		Client(Executor *ex, const char* host, int port = 80,
+		       int timeout = 0)
+			: m_Executor(ex), m_Host(host), m_Port(port),
+			  m_Timeout(timeout) {}
 
-		std::string m_LineBuf;	// line accumulation for states that want it
-		std::string m_HeaderAccum; // accumulation buffer for headers
+		Pending get(const char* url) { return request("GET", url); }
+		Pending request(const char* method, const char* url,
+				const char* headers[] = 0,
+				const unsigned char* body = 0, int bodysize = 0);
 	};
 }	// end namespace happyhttp
 
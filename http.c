@@ -1,40 +1,484 @@
+#define _GNU_SOURCE
 #include "http.h"
+#include "scan.h"
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <time.h>
+#include <limits.h>
 
-extern void err_log(const char *fmt);
-int read_http_hdr_request(const char *request)
+/* RFC 7230 tchar: the bytes allowed in methods and header names */
+static const unsigned char tchar[256] = {
+	['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+	['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+	['`'] = 1, ['|'] = 1, ['~'] = 1,
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+};
+
+static int is_token(const char *p, size_t len)
 {
-	const char *p;
-	char buf[1024], path[1024];
-	int fd, i;
-	
-	p = request;
-	while (*p && *p != '/') 
+	const char *end = p + len;
+
+	if (len == 0)
+		return 0;
+	while (p < end && tchar[(unsigned char) *p])
 		p++;
+	return p == end;
+}
+
+void http_request_init(struct httphdr_request *req)
+{
+	/* headers[] is filled in order, no need to clear it */
+	memset(req, 0, offsetof(struct httphdr_request, headers));
+}
+
+static struct http_slice slice(const char *buf, const char *p, size_t len)
+{
+	struct http_slice s = { p - buf, len };
+
+	return s;
+}
+
+/* does the comma separated header value contain token? */
+static int has_token(const char *buf, struct http_slice v, const char *token)
+{
+	size_t n = strlen(token);
+	const char *p, *end;
+
+	p = buf + v.off;
+	end = p + v.len;
+	while (p + n <= end) {
+		if (strncasecmp(p, token, n) == 0 &&
+		    (p + n == end || p[n] == ',' || p[n] == ' ' || p[n] == '\t'))
+			return 1;
+		if ((p = memchr(p, ',', end - p)) == NULL)
+			break;
+		while (++p < end && (*p == ' ' || *p == '\t'))
+			;
+	}
+	return 0;
+}
+
+/* request line: method SP request-target SP HTTP-version */
+static int parse_request_line(struct httphdr_request *req, const char *buf,
+			      const char *p, const char *eol)
+{
+	const char *sp1, *sp2;
+
+	if ((sp1 = memchr(p, ' ', eol - p)) == NULL ||
+	    (sp2 = memchr(sp1 + 1, ' ', eol - sp1 - 1)) == NULL)
+		return 400;
+	if (!is_token(p, sp1 - p))
+		return 400;
+	if (sp2 - sp1 - 1 > HTTP_MAX_TARGET)
+		return 414;
+	if (sp2 == sp1 + 1 || eol - sp2 - 1 != 8 ||
+	    memcmp(sp2 + 1, "HTTP/1.", 7) != 0 ||
+	    (sp2[8] != '0' && sp2[8] != '1'))
+		return 400;
+	req->method = slice(buf, p, sp1 - p);
+	req->target = slice(buf, sp1 + 1, sp2 - sp1 - 1);
+	req->minor_version = sp2[8] - '0';
+	return 0;
+}
+
+/* case-insensitive match of a header name against a lowercase one */
+static int name_is(const char *p, const char *lower, size_t len)
+{
+	while (len-- > 0)
+		if ((*p++ | 0x20) != *lower++)	/* names are tokens */
+			return 0;
+	return 1;
+}
+
+/* remember the headers the server looks at */
+static void known_header(struct httphdr_request *req, const char *name,
+			 size_t len, struct http_slice value)
+{
+	static const struct {
+		const char *name;
+		size_t len, offset;
+	} known[] = {
+#define KNOWN(s, field)	\
+	{ s, sizeof(s) - 1, offsetof(struct httphdr_request, field) }
+		KNOWN("host", host),
+		KNOWN("user-agent", user_agent),
+		KNOWN("accept", accept),
+		KNOWN("accept-language", accept_language),
+		KNOWN("accept-encoding", accept_encoding),
+		KNOWN("connection", connection),
+		KNOWN("content-length", content_length),
+		KNOWN("transfer-encoding", transfer_encoding),
+#undef KNOWN
+	};
+	int i;
+
+	for (i = 0; i < sizeof(known) / sizeof(known[0]); i++)
+		if (known[i].len == len && name_is(name, known[i].name, len)) {
+			*(struct http_slice *) ((char *) req +
+						known[i].offset) = value;
+			return;
+		}
+}
+
+/* header-field: field-name ":" OWS field-value OWS */
+static int parse_header_line(struct httphdr_request *req, const char *buf,
+			     const char *p, const char *eol)
+{
+	const char *colon, *v, *vend;
+	struct http_header *h;
+
+	if (*p == ' ' || *p == '\t')	/* obsolete line folding */
+		return 400;
+	for (colon = p; colon < eol && tchar[(unsigned char) *colon]; colon++)
+		;
+	if (colon == p || colon == eol || *colon != ':')
+		return 400;
+	if (req->nheaders == HTTP_MAX_HEADERS)
+		return 431;
+	for (v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+		;
+	for (vend = eol; vend > v && (vend[-1] == ' ' || vend[-1] == '\t');
+	     vend--)
+		;
+	h = &req->headers[req->nheaders++];
+	h->name = slice(buf, p, colon - p);
+	h->value = slice(buf, v, vend - v);
+	known_header(req, p, colon - p, h->value);
+	return 0;
+}
+
+/*
+ * Parse as much of the request header in buf[0, len) as has arrived.
+ * Only complete lines are parsed, each exactly once: req remembers where
+ * to resume when more data has been appended to buf. Nothing is copied,
+ * fields are recorded as slices of buf.
+ *
+ * Returns HTTP_AGAIN while the header is incomplete, 0 once it has been
+ * parsed (req->hdrlen bytes), or the status to reject the request with:
+ * 400 malformed, 414 target too long, 431 header too large.
+ */
+int http_parse_request(struct httphdr_request *req, const char *buf,
+		       size_t len)
+{
+	const char *p, *eol, *end;
+	int err;
+
+	end = buf + (len < HTTP_MAX_HEADER ? len : HTTP_MAX_HEADER);
+	for (p = buf + req->pos; p < end; p = buf + req->pos) {
+		if ((eol = scan_eol(p, end)) == end) {
+			if (req->target.len == 0 &&
+			    end - p > HTTP_MAX_TARGET + 64)
+				return 414;
+			break;
+		}
+		req->pos = eol + 1 - buf;
+		if (eol > p && eol[-1] == '\r')
+			eol--;
+		if (req->target.len == 0) {
+			if (eol == p && req->method.len == 0)
+				continue;	/* tolerate CRLF before a request */
+			if ((err = parse_request_line(req, buf, p, eol)) != 0)
+				return err;
+		} else if (eol == p) {
+			req->hdrlen = req->pos;
+			req->keepalive = req->minor_version == 1 ?
+				!has_token(buf, req->connection, "close") :
+				has_token(buf, req->connection, "keep-alive");
+			return 0;
+		} else if ((err = parse_header_line(req, buf, p, eol)) != 0) {
+			return err;
+		}
+	}
+	if (len < HTTP_MAX_HEADER)
+		return HTTP_AGAIN;
+	return req->target.len == 0 ? 414 : 431;
+}
+
+static int hexval(int c)
+{
+	if (isdigit(c))
+		return c - '0';
+	c = tolower(c);
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
 
-	strcat(path, "www/");
-	p++;
-	for (i = 0; *p && !isspace(*p); p++, i++)
-		buf[i] = *p;
-	buf[i] = '\0';
-	if (i == 0)
-		strcat(path, "index.html");
-	else
-		strcat(path, buf);
-	fd = open(path, O_RDONLY);
-	if (fd == -1) 
-		err_log("open error");
+/*
+ * Turn the request target [p, end) into a path relative to www/: drop
+ * the query, decode %XX escapes, collapse "//" and "." and resolve "..".
+ * Returns -1 if the target is malformed or escapes www/.
+ */
+static int normalize_path(const char *p, const char *end, char *path,
+			  size_t size)
+{
+	char *q, *seg;
+	int hi, lo;
+
+	q = path;
+	seg = path;	/* start of the current segment */
+	for (; p < end && *p != '?' && *p != '#'; p++) {
+		if (q == path + size - 1)
+			return -1;
+		if (*p == '%') {
+			if (end - p < 3 || (hi = hexval(p[1])) < 0 ||
+			    (lo = hexval(p[2])) < 0 || (hi | lo) == 0)
+				return -1;
+			*q = hi << 4 | lo;
+			p += 2;
+		} else {
+			*q = *p;
+		}
+		if (*q != '/') {
+			q++;
+			continue;
+		}
+		/* end of a segment */
+		if (q == seg || (q - seg == 1 && seg[0] == '.')) {
+			q = seg;
+		} else if (q - seg == 2 && seg[0] == '.' && seg[1] == '.') {
+			if (seg == path)
+				return -1;
+			for (q = seg - 1; q > path && q[-1] != '/'; q--)
+				;
+		} else {
+			q++;
+		}
+		seg = q;
+	}
+	if (q - seg == 1 && seg[0] == '.') {
+		q = seg;
+	} else if (q - seg == 2 && seg[0] == '.' && seg[1] == '.') {
+		if (seg == path)
+			return -1;
+		for (q = seg - 1; q > path && q[-1] != '/'; q--)
+			;
+	}
+	*q = '\0';
+	if (q == path || q[-1] == '/') {
+		if (q + sizeof("index.html") > path + size)
+			return -1;
+		strcpy(q, "index.html");
+	}
+	return 0;
+}
+
+/* does slice s of buf hold exactly the string lit? */
+static int slice_is(const char *buf, struct http_slice s, const char *lit)
+{
+	return s.len == strlen(lit) && memcmp(buf + s.off, lit, s.len) == 0;
+}
+
+/* Content-Length: 1*DIGIT, and no more than fits in a long */
+static int parse_content_length(const char *buf, struct http_slice s,
+				long *len)
+{
+	const char *p = buf + s.off, *end = p + s.len;
+
+	if (p == end)
+		return -1;
+	for (*len = 0; p < end; p++) {
+		if (*p < '0' || *p > '9' || *len > (LONG_MAX - 9) / 10)
+			return -1;
+		*len = *len * 10 + (*p - '0');
+	}
+	return 0;
+}
+
+/*
+ * buf holds the len bytes received so far, possibly several pipelined
+ * requests; req carries the parse state from previous calls. Returns
+ * HTTP_AGAIN until the first request header is complete, then the
+ * response status: 200 with the requested file under www/ in *file, 404
+ * if there is no such file, 501 for a method other than GET and HEAD,
+ * or the parser's 400/414/431. req->hdrlen is the length of the request,
+ * req->keepalive tells whether the client wants the connection kept open
+ * and req->head that it only wants the header.
+ */
+int read_http_hdr_request(struct httphdr_request *req, const char *buf,
+			  size_t len, struct fcache_entry **file)
+{
+	const char *target;
+	char path[FCACHE_PATHMAX];
+	long length;
+	int status;
+
+	if ((status = http_parse_request(req, buf, len)) != 0)
+		return status;
+	req->head = slice_is(buf, req->method, "HEAD");
+	if (!req->head && !slice_is(buf, req->method, "GET"))
+		return 501;
+	/* no request bodies: we couldn't find the next pipelined request */
+	if (req->transfer_encoding.len > 0 ||
+	    (req->content_length.len > 0 &&
+	     (parse_content_length(buf, req->content_length, &length) == -1 ||
+	      length != 0)))
+		return 400;
+
+	target = buf + req->target.off;
+	if (*target != '/' || normalize_path(target + 1,
+					     target + req->target.len,
+					     path, sizeof(path)) == -1)
+		return 400;
+	if ((*file = fcache_get(path)) == NULL)
+		return 404;
+	return 200;
+}
+
+/* status lines we send, with their CRLF */
+static const char *status_line(int status)
+{
+	switch (status) {
+	case 200:
+		return "HTTP/1.1 200 OK\r\n";
+	case 400:
+		return "HTTP/1.1 400 Bad Request\r\n";
+	case 404:
+		return "HTTP/1.1 404 Not Found\r\n";
+	case 414:
+		return "HTTP/1.1 414 URI Too Long\r\n";
+	case 431:
+		return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+	case 501:
+		return "HTTP/1.1 501 Not Implemented\r\n";
+	default:
+		return "HTTP/1.1 500 Internal Server Error\r\n";
+	}
+}
 
-	return fd;
+/* Content-Type line for a file, by its extension */
+const char *http_content_type(const char *path)
+{
+	static const struct {
+		const char *ext, *line;
+	} types[] = {
+		{ "html", "Content-Type: text/html\r\n" },
+		{ "htm", "Content-Type: text/html\r\n" },
+		{ "css", "Content-Type: text/css\r\n" },
+		{ "js", "Content-Type: application/javascript\r\n" },
+		{ "json", "Content-Type: application/json\r\n" },
+		{ "txt", "Content-Type: text/plain\r\n" },
+		{ "xml", "Content-Type: application/xml\r\n" },
+		{ "png", "Content-Type: image/png\r\n" },
+		{ "jpg", "Content-Type: image/jpeg\r\n" },
+		{ "jpeg", "Content-Type: image/jpeg\r\n" },
+		{ "gif", "Content-Type: image/gif\r\n" },
+		{ "svg", "Content-Type: image/svg+xml\r\n" },
+		{ "ico", "Content-Type: image/x-icon\r\n" },
+		{ "pdf", "Content-Type: application/pdf\r\n" },
+		{ "wasm", "Content-Type: application/wasm\r\n" },
+	};
+	const char *ext;
+	int i;
+
+	if ((ext = strrchr(path, '.')) != NULL && !strchr(ext, '/'))
+		for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+			if (strcasecmp(ext + 1, types[i].ext) == 0)
+				return types[i].line;
+	return "Content-Type: application/octet-stream\r\n";
+}
+
+static char keepalive_line[64] = "Connection: keep-alive\r\n";
+
+/* precompute the header lines that depend on the configuration */
+void init_http_hdr_response(int keepalive_timeout)
+{
+	snprintf(keepalive_line, sizeof(keepalive_line),
+		 "Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n",
+		 keepalive_timeout);
+}
+
+/* "Date: ...\r\n" for the current second, formatted once per second */
+static const char *date_line(void)
+{
+	static char line[40];
+	static time_t last = -1;
+	struct tm tm;
+	time_t t;
+
+	if ((t = time(NULL)) != last) {
+		gmtime_r(&t, &tm);
+		strftime(line, sizeof(line),
+			 "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+		last = t;
+	}
+	return line;
 }
 
-void send_http_hdr_response(int fd)
+/*
+ * Fill resp for a response with the given status and body length; file
+ * is the file being sent, if any.
+ */
+void fill_http_hdr_response(struct httphdr_response *resp, int status,
+			    off_t length, const struct fcache_entry *file,
+			    int keepalive)
 {
-	
+	char digits[24], *p, *q;
+
+	resp->status = status_line(status);
+	resp->server = "Server: httpd\r\n";
+	resp->accept_ranges = NULL;	/* no range support */
+	resp->connection = keepalive ? keepalive_line : "Connection: close\r\n";
+	resp->content_type = file ? file->content_type : NULL;
+	resp->etag = file ? file->etag : NULL;
+	resp->last_modified = file ? file->last_modified : NULL;
+
+	/* copy: date_line() may change while this header is being sent */
+	memcpy(resp->date_buf, date_line(), sizeof(resp->date_buf));
+	resp->date = resp->date_buf;
+
+	if (length == 0) {
+		resp->content_length = "Content-Length: 0\r\n";
+	} else {
+		p = digits + sizeof(digits);
+		do
+			*--p = '0' + length % 10;
+		while ((length /= 10) > 0);
+		q = resp->length_buf;
+		memcpy(q, "Content-Length: ", 16);
+		q += 16;
+		memcpy(q, p, digits + sizeof(digits) - p);
+		q += digits + sizeof(digits) - p;
+		memcpy(q, "\r\n", 3);
+		resp->content_length = resp->length_buf;
+	}
 }
 
+static int add_line(struct iovec *iov, int n, const char *line)
+{
+	if (line == NULL)
+		return n;
+	iov[n].iov_base = (void *) line;
+	iov[n].iov_len = strlen(line);
+	return n + 1;
+}
+
+/*
+ * Point iov at the requested parts of resp's header (HDR_FIXED, HDR_VARY,
+ * HDR_END), in that order. iov needs room for HTTP_HDR_IOVMAX entries.
+ * Returns the number of entries used.
+ */
+int build_http_hdr_response(const struct httphdr_response *resp,
+			    struct iovec *iov, int parts)
+{
+	int n = 0;
 
+	if (parts & HDR_FIXED) {
+		n = add_line(iov, n, resp->status);
+		n = add_line(iov, n, resp->server);
+		n = add_line(iov, n, resp->accept_ranges);
+		n = add_line(iov, n, resp->content_type);
+		n = add_line(iov, n, resp->content_length);
+		n = add_line(iov, n, resp->etag);
+		n = add_line(iov, n, resp->last_modified);
+	}
+	if (parts & HDR_VARY) {
+		n = add_line(iov, n, resp->date);
+		n = add_line(iov, n, resp->connection);
+	}
+	if (parts & HDR_END)
+		n = add_line(iov, n, "\r\n");
+	return n;
+}
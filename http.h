@@ -1,25 +1,93 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "fcache.h"
+
+#define HTTP_AGAIN	(-2)	/* request header incomplete, read more */
+
+#define HTTP_MAX_HEADER	8192	/* request line and headers, in bytes */
+#define HTTP_MAX_TARGET	2048
+#define HTTP_MAX_HEADERS 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a field of a request, as an offset and length into the request buffer */
+struct http_slice {
+	unsigned short off, len;
+};
+
+struct http_header {
+	struct http_slice name, value;
+};
+
+/*
+ * A parsed request header. Nothing is copied out of the receive buffer;
+ * all fields are slices of it, zero length when absent.
+ */
 struct httphdr_request {
-	char *host;
-	char *user_agent;
-	char *accept;
-	char *accept_language;
-	char *accpet_encoding;
-	char *connection;
+	size_t pos;		/* parsed up to here */
+	size_t hdrlen;		/* length of the header once complete */
+	struct http_slice method;
+	struct http_slice target;
+	int minor_version;	/* HTTP/1.x */
+	int keepalive;		/* client wants a persistent connection */
+	int head;		/* HEAD: answer with the header only */
+	struct http_slice host;
+	struct http_slice user_agent;
+	struct http_slice accept;
+	struct http_slice accept_language;
+	struct http_slice accept_encoding;
+	struct http_slice connection;
+	struct http_slice content_length;
+	struct http_slice transfer_encoding;
+	int nheaders;
+	struct http_header headers[HTTP_MAX_HEADERS];
 };
 
+/*
+ * A response header as ready-made lines, each with its CRLF, filled in
+ * by fill_http_hdr_response(). NULL lines are left out.
+ */
 struct httphdr_response {
-	char *accept_ranges;
-	char *connection;
-	char *content_type;
-	char *date;
-	char *last_modified;
-	char *server;
+	const char *status;		/* status line */
+	const char *accept_ranges;
+	const char *connection;		/* Connection and Keep-Alive */
+	const char *content_length;
+	const char *content_type;
+	const char *date;
+	const char *etag;
+	const char *last_modified;
+	const char *server;
+	char length_buf[48];		/* storage for content_length */
+	char date_buf[40];		/* storage for date */
 };
 
-int read_http_hdr_request(const char *request);
-void send_http_hdr_response(int fd);
+/* parts of a response header for build_http_hdr_response() */
+#define HDR_FIXED	1	/* lines that only depend on status and file */
+#define HDR_VARY	2	/* Date and Connection */
+#define HDR_END		4	/* the empty line */
+#define HTTP_HDR_IOVMAX	10
+
+void http_request_init(struct httphdr_request *req);
+int http_parse_request(struct httphdr_request *req, const char *buf,
+		       size_t len);
+int read_http_hdr_request(struct httphdr_request *req, const char *buf,
+			  size_t len, struct fcache_entry **file);
+const char *http_content_type(const char *path);
+void init_http_hdr_response(int keepalive_timeout);
+void fill_http_hdr_response(struct httphdr_response *resp, int status,
+			    off_t length, const struct fcache_entry *file,
+			    int keepalive);
+int build_http_hdr_response(const struct httphdr_response *resp,
+			    struct iovec *iov, int parts);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
 #include "httpclient.h"
 #include "map.h"
+#include "scan.h"
 #include <stdbool.h>
 #include <ctype.h>
 #include <assert.h>
+#include <poll.h>
 
 /* http status code 
  * borrowed from "Ben Campbell: happyhttp.h"
@@ -69,8 +72,9 @@ enum http_status_code {
 	NOT_EXTENDED = 510,
 };
 
-#define MAXLINE 2048
-static void response_init(void);
+/* bodies of known length at least this big are spliced to the sink */
+#define SPLICE_MIN (16 << 10)
+#define SINK_PIPE_SIZE (1 << 20)
 
 int tcp_connect(const char *host)
 {
@@ -99,42 +103,91 @@ int tcp_connect(const char *host)
 	return sockfd;
 }
 
-void http_request_handler(int sockfd, const char *method,
+/*
+ * -1 with errno set if the request couldn't be written, EMSGSIZE if it
+ * is too long. Waits for a non-blocking socket to take all of it.
+ */
+int http_request_handler(int sockfd, const char *method,
 				 const char *url, const char *host)
 {
 	char req_data[BUFSIZ];
+	struct pollfd pfd;
+	const char *p;
+	ssize_t n;
+	int len;
 
 	if (url == NULL)
 		url = "/";
-	sprintf(req_data,
-		"%s %s HTTP/1.1\r\n"
-		"Host: %s\r\n"		
-		"User-Agent: curl/7.35.0\r\n"
-		"Accept-Encoding: identity\r\n"
-		"\r\n", method, url, host);
-	if (write(sockfd, req_data, strlen(req_data)) == -1)
-		err_sys("write error");
+	len = snprintf(req_data, sizeof(req_data),
+		       "%s %s HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "User-Agent: curl/7.35.0\r\n"
+		       "Accept-Encoding: identity\r\n"
+		       "\r\n", method, url, host);
+	if (len < 0 || len >= sizeof(req_data)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	for (p = req_data; len > 0; p += n, len -= n) {
+		if ((n = write(sockfd, p, len)) >= 0)
+			continue;
+		if (errno != EINTR && errno != EAGAIN)
+			return -1;
+		if (errno == EAGAIN) {
+			pfd.fd = sockfd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+		}
+		n = 0;
+	}
+	return 0;
+}
+
+void http_response_init(struct http_response *r)
+{
+	memset(&r->arena, 0, sizeof(r->arena));
+	r->sink = STDOUT_FILENO;
+	r->sink_pipe[0] = r->sink_pipe[1] = -1;
+	r->sink_nosplice = false;
+	r->trace = stdout;
+	http_response_reset(r);
+}
+
+void http_response_free(struct http_response *r)
+{
+	arena_free(&r->arena);
+	if (r->sink_pipe[0] != -1) {
+		close(r->sink_pipe[0]);
+		close(r->sink_pipe[1]);
+	}
+}
+
+/* get ready for the next response, dropping the last one's headers */
+void http_response_reset(struct http_response *r)
+{
+	r->state = STATUSLINE;
+	r->status = 0;
+	r->chunked = false;
+	r->chunkleft = r->content_length = 0;
+	r->linelen = 0;
+	r->header_accum[0] = '\0';
+	arena_reset(&r->arena);
+	map_init(&r->map, &r->arena);
 }
 
-/* handles parsing of response data. borrowed from "Ben " */
-enum response_state {
-	STATUSLINE,
-	HEADERS,
-	CHUNKLEN,	/* expecting a chunk length indicator (in hex) */
-	CHUNKEND,
-	BODY,
-	TRAILERS,       /* trailers after body */
-	COMPLETE,
-} m_state;
-
-void http_response_handler(int sockfd)
+void http_response_sink(struct http_response *r, int fd)
+{
+	r->sink = fd;
+	r->sink_nosplice = false;
+}
+
+void http_response_handler(struct http_response *r, int sockfd)
 {
 	ssize_t nread;
-	char buf[BUFSIZ];
 	int nready;	
 	fd_set rset;
 
-	response_init();	
+	http_response_reset(r);
 	FD_ZERO(&rset);
 	for (;;) {
 		FD_SET(sockfd, &rset);
@@ -148,236 +201,350 @@ void http_response_handler(int sockfd)
 			continue;
 		}
 		if (FD_ISSET(sockfd, &rset)) {
-			nread = read(sockfd, buf, sizeof(buf));
+			nread = http_response_read(r, sockfd);
 			if (nread == 0)
 				break;
 			else if (nread == -1)
 				err_sys("read error");
-			pump(sockfd, buf, nread);
-			if (m_state == TRAILERS || m_state == COMPLETE)
+			if (http_response_done(r))
 				break;
 		}
 	}
 	close(sockfd);
 }
 
-static ssize_t chunkleft = 0, content_length = 0;
-struct map map = { { 0, "" }, { 0, "" }, NULL, NULL };
-static char header_accum[2048];
-int stat_code;
-bool m_chunked;
+/*
+ * The response is complete; for a chunked one that includes the
+ * trailers, so the next response on the connection starts clean.
+ */
+bool http_response_done(const struct http_response *r)
+{
+	return r->state == COMPLETE || (r->state == TRAILERS && !r->chunked);
+}
 
-static void response_init(void)
+/* is what comes next better spliced to the sink than read? */
+static bool sink_splicing(struct http_response *r)
 {
-	m_state = STATUSLINE;
-	m_chunked = false;
+	if (r->state != BODY || r->chunked ||
+	    r->content_length < SPLICE_MIN || r->sink_nosplice)
+		return false;
+	if (r->sink_pipe[0] == -1) {
+		if (pipe(r->sink_pipe) == -1) {
+			r->sink_pipe[0] = -1;
+			r->sink_nosplice = true;
+			return false;
+		}
+		/* fewer, bigger splices if we may, the default is 64KB */
+		fcntl(r->sink_pipe[1], F_SETPIPE_SZ, SINK_PIPE_SIZE);
+		r->sink_pipe_size = fcntl(r->sink_pipe[1], F_GETPIPE_SZ);
+	}
+	return true;
 }
 
-void pump(int sockfd, const char *data, ssize_t size)
+/* write all of data to the sink */
+static void sink_write(struct http_response *r, const char *data,
+		       size_t size)
 {
-	int i, ch;
-	ssize_t used, count;
-	static char line[MAXLINE];
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = write(r->sink, data, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err_sys("write error");
+		}
+		data += n;
+		size -= n;
+	}
+}
+
+/*
+ * Move what has arrived of a known-length body from the socket to the
+ * sink through a pipe, so it never gets copied to user space. Returns
+ * the number of bytes moved, 0 if the server closed the connection, or
+ * -1 with errno set.
+ */
+static ssize_t sink_splice(struct http_response *r, int sockfd)
+{
+	char buf[BUFSIZ];
+	ssize_t n, m, left;
+
+	n = splice(sockfd, NULL, r->sink_pipe[1], NULL,
+		   (size_t) r->content_length < r->sink_pipe_size ?
+		   r->content_length : r->sink_pipe_size, SPLICE_F_MOVE);
+	if (n <= 0)
+		return n;
+	for (left = n; left > 0; left -= m) {
+		m = splice(r->sink_pipe[0], NULL, r->sink, NULL, left,
+			   SPLICE_F_MOVE);
+		if (m > 0)
+			continue;
+		if (m == -1 && errno == EINTR) {
+			m = 0;
+			continue;
+		}
+		/* the sink won't take it this way, read it back and write it */
+		if (m == -1 && errno == EINVAL)
+			r->sink_nosplice = true;
+		else
+			err_sys("splice error");
+		for (; left > 0; left -= m) {
+			m = read(r->sink_pipe[0], buf, (size_t) left < sizeof(buf) ?
+				 left : sizeof(buf));
+			if (m <= 0)
+				err_sys("read error");
+			sink_write(r, buf, m);
+		}
+		break;
+	}
+	r->content_length -= n;
+	if (r->content_length == 0)
+		r->state = TRAILERS;
+	return n;
+}
+
+/*
+ * Read what sockfd has of the response and parse it, or splice it to
+ * the sink. Returns the number of bytes read, 0 if the server closed
+ * the connection, or -1 with errno set; EAGAIN if sockfd is
+ * non-blocking and has nothing.
+ */
+ssize_t http_response_read(struct http_response *r, int sockfd)
+{
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	if (sink_splicing(r))
+		return sink_splice(r, sockfd);
+	if ((n = read(sockfd, buf, sizeof(buf))) > 0)
+		pump(r, buf, n);
+	else if (n == 0 && r->state == BODY && r->content_length < 0)
+		r->state = COMPLETE;	/* the close ends the body */
+	return n;
+}
+
+void pump(struct http_response *r, const char *data, ssize_t size)
+{
+	const char *eol;
+	ssize_t used, count, n;
 
 	count = size;
-	while (count > 0 && m_state != COMPLETE) {
-		if (m_state != BODY) {
-			i = 0;
-			while (count-- > 0) {
-				ch = *data++;
-				if (ch == '\n') {
-					line[i] = '\0';
-					process_whole_line(line);
-					break;
-				}
-				if (ch != '\r') 
-					line[i++] = ch;
-			}
+	while (count > 0 && r->state != COMPLETE) {
+		if (r->state != BODY) {
+			/* a line may span reads, keep what we have so far */
+			eol = scan_eol(data, data + count);
+			n = eol - data;
+			if (n > MAXLINE - 1 - r->linelen)
+				n = MAXLINE - 1 - r->linelen;	/* truncate */
+			memcpy(r->line + r->linelen, data, n);
+			r->linelen += n;
+			if (eol == data + count)
+				break;
+			count -= eol + 1 - data;
+			data = eol + 1;
+			if (r->linelen > 0 && r->line[r->linelen - 1] == '\r')
+				r->linelen--;
+			r->line[r->linelen] = '\0';
+			r->linelen = 0;
+			process_whole_line(r, r->line);
 		} else {
-			if (m_chunked) {
-				if (count > chunkleft)
-					size = chunkleft;
+			if (r->chunked) {
+				if (count > r->chunkleft)
+					size = r->chunkleft;
 				else
 					size = count;
-				used = process_chunked_data(data, size);
+				used = process_chunked_data(r, data, size);
 			} else {
-				if (count > content_length)
-					size = content_length;
+				if (r->content_length >= 0 &&
+				    count > r->content_length)
+					size = r->content_length;
 				else
 					size = count;
-				used = process_nonchunked_data(data, size);
+				used = process_nonchunked_data(r, data, size);
 			}
 			data += used;
 			count -= used;
-			while (count-- > 0 && *data == '\n') {
-				putchar('\n');
+			while (count > 0 && *data == '\n') {
+				if (r->trace)
+					putc('\n', r->trace);
 				data++;
+				count--;
 			}
 		}
-		if (m_state == TRAILERS)
-			close(sockfd);
 	}
 }
 
-void process_whole_line(const char *line)
+void process_whole_line(struct http_response *r, const char *line)
 {
-	switch (m_state) {
+	switch (r->state) {
 	case STATUSLINE:
-		process_statusline(line);
+		process_statusline(r, line);
 		break;
 	case HEADERS:
-		process_headers(line);
+		process_headers(r, line);
 		break;
 	case CHUNKLEN:
-		process_chunklen(line);
+		process_chunklen(r, line);
 		break;
 	case TRAILERS:
-		process_trailers(line);
+		process_trailers(r, line);
 		break;
 	case CHUNKEND:
-		assert(m_chunked);
-		m_state = CHUNKLEN;
+		assert(r->chunked);
+		r->state = CHUNKLEN;
 		break;
 	default:
 		break;
 	}
 }
 
-void process_statusline(const char *line)
+void process_statusline(struct http_response *r, const char *line)
 {
-	const char *p = line;
-	static int i;
-	char status_code[4]; /* status code: 1XX ~ 5XX */
-	char http_version[10], reason[100];    /* status reason: e.g 200 OK */
-
-	while (*p && isspace(*p)) 
-		putchar(*p++);
-	i = 0;
-	while (*p && !isspace(*p))
-		http_version[i++] = *p++;
-	http_version[i] = '\0';
-
-	while (*p && isspace(*++p))
-		;
-	i = 0;
-	while (*p && !isspace(*p))
-		status_code[i++] = *p++;
-	status_code[i] = '\0';
-	stat_code = atoi(status_code);
-	while (*p && isspace(*++p))
+	const char *p, *end, *version, *code;
+	int vlen, clen;
+
+	end = line + strlen(line);
+	for (p = line; p < end && isspace(*p); p++)
 		;
-	strcpy(reason, p);
-	printf("%s %s %s\n", http_version, status_code, reason);
-	m_state = HEADERS;
+	version = p;
+	p = scan_delim(p, end);
+	vlen = p - version;
+	while (p < end && isspace(*p))
+		p++;
+	code = p;
+	p = scan_delim(p, end);
+	clen = p - code;
+	r->status = atoi(code);
+	while (p < end && isspace(*p))
+		p++;
+	if (r->trace)
+		fprintf(r->trace, "%.*s %.*s %s\n", vlen, version, clen, code,
+			p);
+	r->state = HEADERS;
 }
 
-void process_headers(const char *line)
+void process_headers(struct http_response *r, const char *line)
 {
 	const char *p = line;
 	
 	if (line[0] == '\0') {
-		flush_headers();
-		if (stat_code == CONTINUE)
-			m_state = STATUSLINE;
+		flush_headers(r);
+		if (r->status == CONTINUE)
+			r->state = STATUSLINE;
 		else
-			begin_body();
+			begin_body(r);
 		return;
 	}
 
 	if (isspace(*p)) { /* continous line */
 		while (*p && isspace(*++p))
 			;
-		strcat(header_accum, " ");
-		strcat(header_accum, p);
+		strcat(r->header_accum, " ");
+		strcat(r->header_accum, p);
 	} else {
-		flush_headers();
-		strcpy(header_accum, p);
+		flush_headers(r);
+		strcpy(r->header_accum, p);
 	}
 }
 
-void flush_headers(void)
+void flush_headers(struct http_response *r)
 {
-	char header[128], value[1024], *p;
+	char header[128];
+	const char *p, *end, *colon;
 	int i;
 	
-	p = header_accum;
+	p = r->header_accum;
 	if (p[0] == '\0')
 		return;
 	
-	for (i = 0; *p && *p != ':'; i++, p++)
+	end = p + strlen(p);
+	colon = scan_delim(p, end);
+	for (i = 0; p < colon && i < sizeof(header) - 1; i++, p++)
 		header[i] = tolower(*p);
 	header[i] = '\0';
 
+	p = colon;
+	while (p < end && isspace(*p))
+		p++;
 	if (*p == ':')
 		p++;	/* skip ':' */
-	while (*p && isspace(*p))
+	while (p < end && isspace(*p))
 		p++;
-	strncpy(value, p, strlen(p) + 1);
-	map_insert(&map, header, value);
-	printf("%s: %s\n", header, value);
-	header_accum[0] = '\0';
+	map_insert(&r->map, header, i, p, end - p);
+	if (r->trace)
+		fprintf(r->trace, "%s: %s\n", header, p);
+	r->header_accum[0] = '\0';
 }
 
-void begin_body(void)
+void begin_body(struct http_response *r)
 {
 	const char *p;
 
-	if (100 <= stat_code && stat_code < 200) {
-		m_state = TRAILERS;  /* This response has no body part */
+	if (r->trace)
+		fflush(r->trace);	/* the body goes to the sink unbuffered */
+	if ((100 <= r->status && r->status < 200) ||
+	    r->status == NO_CONTENT || r->status == NOT_MODIFIED) {
+		r->state = TRAILERS;  /* This response has no body part */
 		return;
 	}
-	p = map_at(&map, "transfer-encoding");
+	p = map_get(&r->map, H_TRANSFER_ENCODING);
 	if (p && strcasecmp(p, "chunked") == 0) {
-		m_chunked = true;
-		m_state = CHUNKLEN;
+		r->chunked = true;
+		r->state = CHUNKLEN;
 		return;
 	}
-	p = map_at(&map, "content-length");
-	assert(p != NULL);
-	content_length = atoi(p);
-	m_state = BODY;
+	p = map_get(&r->map, H_CONTENT_LENGTH);
+	if (p == NULL) {
+		r->content_length = -1;	/* read until the server closes */
+		r->state = BODY;
+		return;
+	}
+	r->content_length = atoi(p);
+	r->state = r->content_length > 0 ? BODY : TRAILERS;
 }
 
-void process_chunklen(const char *line)
+void process_chunklen(struct http_response *r, const char *line)
 {
-	chunkleft = strtol(line, NULL, 16);
-	if (chunkleft == 0) {
-		m_state = TRAILERS;
+	r->chunkleft = strtol(line, NULL, 16);
+	if (r->chunkleft == 0) {
+		r->state = TRAILERS;
 		return;
 	}
-	m_state = BODY;
+	r->state = BODY;
 }
 
-size_t process_chunked_data(const char *data, size_t size)
+size_t process_chunked_data(struct http_response *r, const char *data,
+			    size_t size)
 {
-	static size_t used;
-
-	if ((used = write(STDOUT_FILENO, data, size)) != size)
-		err_sys("write error");
+	size_t used = size;
 
-	chunkleft -= used;
-	assert(chunkleft >= 0);
-	if (chunkleft == 0) 
-		m_state = CHUNKEND;
+	sink_write(r, data, size);
+	r->chunkleft -= used;
+	assert(r->chunkleft >= 0);
+	if (r->chunkleft == 0) 
+		r->state = CHUNKEND;
 	return used;
 }
 
-size_t process_nonchunked_data(const char *data, size_t size)
+size_t process_nonchunked_data(struct http_response *r, const char *data,
+			       size_t size)
 {
-	ssize_t used;
-
-	if ((used = write(1, data, size)) != size)
-		err_sys("write error");
-	content_length -= used;
-	assert(content_length >= 0);
-	if (content_length == 0)
-		m_state = TRAILERS;
+	ssize_t used = size;
+
+	sink_write(r, data, size);
+	if (r->content_length < 0)
+		return used;	/* runs until close */
+	r->content_length -= used;
+	assert(r->content_length >= 0);
+	if (r->content_length == 0)
+		r->state = TRAILERS;
 	return used;
 }
 
-void process_trailers(const char *line)
+void process_trailers(struct http_response *r, const char *line)
 {
-	m_state = COMPLETE;
+	if (line[0] == '\0')
+		r->state = COMPLETE;	/* the rest are ignored */
 }
 
 void err_sys(const char *msg)
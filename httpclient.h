@@ -17,21 +17,77 @@
 #include <sys/select.h>
 #include <netdb.h>
 
+#include <stdbool.h>
+#include "map.h"
+
+#define MAXLINE 2048
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* handles parsing of response data. borrowed from "Ben " */
+enum response_state {
+	STATUSLINE,
+	HEADERS,
+	CHUNKLEN,	/* expecting a chunk length indicator (in hex) */
+	CHUNKEND,
+	BODY,
+	TRAILERS,       /* trailers after body */
+	COMPLETE,
+};
+
+/*
+ * Everything parsing one response at a time on a connection needs, so
+ * a process can have any number of them going. Set up with
+ * http_response_init(), then http_response_reset() before each
+ * response on the connection.
+ */
+struct http_response {
+	enum response_state state;
+	int status;
+	bool chunked;
+	ssize_t chunkleft;
+	ssize_t content_length;	/* body left, -1 if it ends at close */
+	struct arena arena;	/* the response's headers, reset per response */
+	struct map map;
+	char header_accum[2048];
+	char line[MAXLINE];	/* the line being accumulated */
+	size_t linelen;
+	int sink;		/* where bodies go, stdout by default */
+	int sink_pipe[2];	/* for splice() to it, -1 until needed */
+	size_t sink_pipe_size;
+	bool sink_nosplice;	/* the sink doesn't take splice() */
+	FILE *trace;		/* status line and headers go here, or NULL */
+};
+
 void err_sys(const char *msg);
 void err_exit(const char *fmt, ...);
 int tcp_connect(const char *host);
-void http_response_handler(int sockfd);
-void http_request_handler(int sockfd, const char *method,
+int http_request_handler(int sockfd, const char *method,
 				 const char *url, const char *host);
-void pump(int sockfd, const char *buf, ssize_t size);
-void process_whole_line(const char *line);
-void process_statusline(const char *line);
-void process_headers(const char *line);
-void flush_headers(void);
-void begin_body(void);
-void process_chunklen(const char *line);
-size_t process_chunked_data(const char *line, size_t size);
-size_t process_nonchunked_data(const char *line, size_t size);
-void process_trailers(const char *line);
+void http_response_init(struct http_response *r);
+void http_response_free(struct http_response *r);
+void http_response_reset(struct http_response *r);
+void http_response_sink(struct http_response *r, int fd);
+void http_response_handler(struct http_response *r, int sockfd);
+ssize_t http_response_read(struct http_response *r, int sockfd);
+bool http_response_done(const struct http_response *r);
+void pump(struct http_response *r, const char *buf, ssize_t size);
+void process_whole_line(struct http_response *r, const char *line);
+void process_statusline(struct http_response *r, const char *line);
+void process_headers(struct http_response *r, const char *line);
+void flush_headers(struct http_response *r);
+void begin_body(struct http_response *r);
+void process_chunklen(struct http_response *r, const char *line);
+size_t process_chunked_data(struct http_response *r, const char *line,
+			    size_t size);
+size_t process_nonchunked_data(struct http_response *r, const char *line,
+			       size_t size);
+void process_trailers(struct http_response *r, const char *line);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,368 @@
+/*
+ * loadgen - HTTP load generator in the style of wrk, on top of happyhttp
+ *
+ * usage: loadgen [-c conns] [-t threads] [-d secs] [-p depth] [-R rate]
+ *                [-T timeout] [-k] [-H] http://host[:port]/path
+ *   -c  connections, spread over the threads (10)
+ *   -t  threads, each running its own reactor (1)
+ *   -d  seconds to run for (10)
+ *   -p  requests in flight on each connection, pipelined (1)
+ *   -R  requests per second in total, at a fixed rate. Latency is then
+ *       measured from when a request was due rather than from when it
+ *       could be sent, so a server that stalls pays for every request
+ *       it held up (coordinated omission). Without -R each connection
+ *       sends its next request as soon as one is answered.
+ *   -T  ms to wait for a response before counting a timeout (2000)
+ *   -k  no keep-alive: the server closes after each response
+ *   -H  print the whole latency distribution in HdrHistogram's .hgrm
+ *       format as well
+ */
+#include "happyhttp.h"
+#include <unistd.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace happyhttp;
+
+// High dynamic range histogram of latencies in microseconds, to three
+// significant digits: values below 2048 have a count each, above that
+// every power of two is split into 1024 equal steps.
+struct Histogram {
+	static const int SUB_BITS = 11;
+	static const int SUB_HALF = 1 << (SUB_BITS - 1);
+	static const int BUCKETS = 26;		// up to 2^36 us, 19 hours
+	static const int COUNTS = (BUCKETS + 1) * SUB_HALF;
+
+	uint64_t m_Counts[COUNTS] = {};
+	uint64_t m_Total = 0;
+	int64_t m_Max = 0;
+};
+
+static int hist_index(int64_t v)
+{
+	int bucket = 64 - __builtin_clzll(v | (2 * Histogram::SUB_HALF - 1)) -
+		Histogram::SUB_BITS;
+
+	return (bucket << (Histogram::SUB_BITS - 1)) + (int) (v >> bucket);
+}
+
+// the largest value counted at index i
+static int64_t hist_value(int i)
+{
+	int bucket = std::max(i / Histogram::SUB_HALF - 1, 0);
+	int64_t sub = i - bucket * Histogram::SUB_HALF;
+
+	return ((sub + 1) << bucket) - 1;
+}
+
+static void hist_record(Histogram *h, int64_t us)
+{
+	int i = hist_index(std::max<int64_t>(us, 0));
+
+	h->m_Counts[std::min(i, Histogram::COUNTS - 1)]++;
+	h->m_Total++;
+	h->m_Max = std::max(h->m_Max, us);
+}
+
+static void hist_add(Histogram *h, const Histogram *o)
+{
+	for (int i = 0; i < Histogram::COUNTS; i++)
+		h->m_Counts[i] += o->m_Counts[i];
+	h->m_Total += o->m_Total;
+	h->m_Max = std::max(h->m_Max, o->m_Max);
+}
+
+static int64_t hist_percentile(const Histogram *h, double p)
+{
+	uint64_t want = std::max<uint64_t>(ceil(p / 100 * h->m_Total), 1);
+	uint64_t seen = 0;
+
+	for (int i = 0; i < Histogram::COUNTS; i++)
+		if ((seen += h->m_Counts[i]) >= want)
+			return std::min(hist_value(i), h->m_Max);
+	return h->m_Max;
+}
+
+// the percentile spectrum the way HdrHistogram's tools print and plot it
+static void hist_print_hgrm(const Histogram *h)
+{
+	double mean = 0, var = 0, p = 0, next;
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < Histogram::COUNTS; i++)
+		mean += (double) h->m_Counts[i] * hist_value(i);
+	mean /= h->m_Total;
+	for (i = 0; i < Histogram::COUNTS; i++)
+		var += h->m_Counts[i] * pow(hist_value(i) - mean, 2);
+
+	printf("%12s %14s %10s %14s\n\n", "Value", "Percentile",
+	       "TotalCount", "1/(1-Percentile)");
+	for (i = 0; i < Histogram::COUNTS && p < 100; i++) {
+		if (h->m_Counts[i] == 0)
+			continue;
+		seen += h->m_Counts[i];
+		while (p < 100 && seen >= p / 100 * h->m_Total) {
+			printf("%12.3f %2.12f %10lu %14.2f\n",
+			       std::min(hist_value(i), h->m_Max) / 1e3, p / 100,
+			       (unsigned long) seen, 1 / (1 - p / 100));
+			// five reports per halving of the distance to 100%
+			next = pow(2, floor(log2(100 / (100 - p))) + 1) * 5;
+			p += 100 / next;
+			if (seen == h->m_Total)
+				p = 100;
+		}
+	}
+	printf("%12.3f %2.12f %10lu\n", h->m_Max / 1e3, 1.0,
+	       (unsigned long) h->m_Total);
+	printf("#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e3,
+	       sqrt(var / h->m_Total) / 1e3);
+	printf("#[Max     = %12.3f, Total count    = %12lu]\n", h->m_Max / 1e3,
+	       (unsigned long) h->m_Total);
+	printf("#[Buckets = %12d, SubBuckets     = %12d]\n", Histogram::BUCKETS,
+	       2 * Histogram::SUB_HALF);
+}
+
+static const char *host = "127.0.0.1";
+static int port = 80;
+static std::string path = "/";
+static int nconns = 10, nthreads = 1, seconds = 10, depth = 1, timeout = 2000;
+static double rate;			// requests/s, 0 for as fast as answered
+static bool keepalive = true;
+
+struct Worker;
+
+struct Conn {
+	Connection m_Conn;
+	Worker *m_Worker;
+	std::deque<int64_t> m_Starts;	// of the requests in flight, ns
+	int64_t m_Next;			// the next request is due, ns
+};
+
+struct Worker {
+	Reactor m_Reactor;
+	std::vector<std::unique_ptr<Conn>> m_Conns;
+	std::unique_ptr<Histogram> m_Hist;
+	int64_t m_Interval;		// ns between requests per connection
+	uint64_t m_Requests, m_Bytes, m_Timeouts, m_Errors, m_Bad;
+	std::thread m_Thread;
+};
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void on_data(const Response *r, void *userdata,
+		    const unsigned char *data, int n)
+{
+	((Conn *) userdata)->m_Worker->m_Bytes += n;
+}
+
+static void on_complete(const Response *r, void *userdata)
+{
+	Conn *c = (Conn *) userdata;
+	Worker *w = c->m_Worker;
+	int64_t start = c->m_Starts.front();
+
+	c->m_Starts.pop_front();
+	if (geterror(r) == ETIMEDOUT) {
+		w->m_Timeouts++;
+	} else if (geterror(r)) {
+		w->m_Errors++;
+	} else {
+		hist_record(w->m_Hist.get(), (now_ns() - start) / 1000);
+		w->m_Requests++;
+		if (getstatus(r) >= 400)
+			w->m_Bad++;
+	}
+}
+
+// send what c may: up to depth in flight, and only those due by now
+static void top_up(Conn *c, int64_t now)
+{
+	static const char *close_hdr[] = { "Connection", "close", NULL };
+	Worker *w = c->m_Worker;
+	int64_t start;
+
+	while (c->m_Starts.size() < (size_t) depth) {
+		if (w->m_Interval) {
+			if (c->m_Next > now)
+				break;
+			start = c->m_Next;	// even if it is late
+			c->m_Next += w->m_Interval;
+		} else {
+			start = now;
+		}
+		c->m_Starts.push_back(start);
+		request(&c->m_Conn, "GET", path.c_str(),
+			keepalive ? NULL : close_hdr);
+	}
+}
+
+static void run_worker(Worker *w, int64_t end)
+{
+	int64_t now, wait;
+
+	while ((now = now_ns()) < end) {
+		wait = end - now;
+		for (auto &c : w->m_Conns) {
+			top_up(c.get(), now);
+			if (w->m_Interval && c->m_Starts.size() < (size_t) depth)
+				wait = std::min(wait, c->m_Next - now);
+		}
+		reactor_run(&w->m_Reactor,
+			    std::min<int64_t>(std::max<int64_t>(wait, 0) / 1000000,
+					      100));
+	}
+	for (auto &c : w->m_Conns) {
+		reactor_remove(&w->m_Reactor, &c->m_Conn);
+		connection_destroy(&c->m_Conn);
+	}
+	reactor_destroy(&w->m_Reactor);
+}
+
+static void die(const char *msg, const char *arg)
+{
+	fprintf(stderr, msg, arg);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_url(const char *url)
+{
+	static std::string h;
+	const char *p, *slash, *colon;
+
+	if (strncmp(url, "http://", 7) != 0)
+		die("%s: only http:// URLs\n", url);
+	p = url + 7;
+	slash = strchr(p, '/');
+	if (slash == NULL)
+		slash = p + strlen(p);
+	colon = (const char *) memchr(p, ':', slash - p);
+	h.assign(p, colon ? colon : slash);
+	host = h.c_str();
+	port = colon ? atoi(colon + 1) : 80;
+	if (*slash)
+		path = slash;
+}
+
+static void usage()
+{
+	die("Usage: %s [-c conns] [-t threads] [-d secs] [-p depth] "
+	    "[-R rate]\n               [-T timeout] [-k] [-H] "
+	    "http://host[:port]/path\n", "loadgen");
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t requests = 0, bytes = 0, timeouts = 0, errors = 0, bad = 0;
+	bool hgrm = false;
+	int64_t start, end;
+	double secs;
+	int opt, i, k;
+
+	while ((opt = getopt(argc, argv, "c:t:d:p:R:T:kH")) != -1) {
+		switch (opt) {
+		case 'c': nconns = atoi(optarg); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'p': depth = atoi(optarg); break;
+		case 'R': rate = atof(optarg); break;
+		case 'T': timeout = atoi(optarg); break;
+		case 'k': keepalive = false; break;
+		case 'H': hgrm = true; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || nconns < 1 || nthreads < 1 || depth < 1)
+		usage();
+	parse_url(argv[optind]);
+	if (nthreads > nconns)
+		nthreads = nconns;
+	if (!keepalive)
+		depth = 1;	// nothing can follow a request on its connection
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	start = now_ns();
+	end = start + seconds * 1000000000LL;
+	for (i = k = 0; i < nthreads; i++) {
+		auto w = std::make_unique<Worker>();
+		int n = nconns / nthreads + (i < nconns % nthreads);
+
+		reactor_init(&w->m_Reactor);
+		w->m_Hist = std::make_unique<Histogram>();
+		w->m_Interval = rate > 0 ? (int64_t) (1e9 * nconns / rate) : 0;
+		w->m_Requests = w->m_Bytes = w->m_Timeouts = 0;
+		w->m_Errors = w->m_Bad = 0;
+		for (int j = 0; j < n; j++, k++) {
+			auto c = std::make_unique<Conn>();
+
+			c->m_Worker = w.get();
+			// spread the connections' schedules evenly
+			c->m_Next = start + w->m_Interval * k / nconns;
+			connection_init(&c->m_Conn, host, port);
+			setcallbacks(&c->m_Conn, NULL, on_data, on_complete,
+				     c.get());
+			settrace(&c->m_Conn, NULL);
+			settimeout(&c->m_Conn, timeout);
+			setpipeline(&c->m_Conn, depth);
+			reactor_add(&w->m_Reactor, &c->m_Conn);
+			w->m_Conns.push_back(std::move(c));
+		}
+		workers.push_back(std::move(w));
+	}
+
+	printf("Running %ds test @ %s\n", seconds, argv[optind]);
+	printf("  %d threads and %d connections, %d in flight each, %s",
+	       nthreads, nconns, depth, keepalive ? "keep-alive" :
+	       "connection per request");
+	if (rate > 0)
+		printf(", %.0f requests/s", rate);
+	printf("\n");
+	fflush(stdout);
+	for (auto &w : workers)
+		w->m_Thread = std::thread(run_worker, w.get(), end);
+
+	auto all = std::make_unique<Histogram>();
+	for (auto &w : workers) {
+		w->m_Thread.join();
+		hist_add(all.get(), w->m_Hist.get());
+		requests += w->m_Requests;
+		bytes += w->m_Bytes;
+		timeouts += w->m_Timeouts;
+		errors += w->m_Errors;
+		bad += w->m_Bad;
+	}
+	secs = (now_ns() - start) / 1e9;
+
+	printf("  %lu requests in %.2fs, %.2fMB of bodies read\n",
+	       (unsigned long) requests, secs, bytes / 1e6);
+	if (timeouts || errors || bad)
+		printf("  timeouts %lu, errors %lu, status >= 400 %lu\n",
+		       (unsigned long) timeouts, (unsigned long) errors,
+		       (unsigned long) bad);
+	printf("Requests/sec: %10.2f\n", requests / secs);
+	printf("Transfer/sec: %10.2fMB\n", bytes / secs / 1e6);
+	if (requests == 0)
+		return 1;
+	printf("Latency distribution (ms)\n");
+	for (double p : { 50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 100.0 })
+		printf("  %7.3f%% %10.3f\n", p, hist_percentile(all.get(), p) / 1e3);
+	if (hgrm) {
+		printf("\n");
+		hist_print_hgrm(all.get());
+	}
+	return 0;
+}
@@ -1,17 +1,496 @@
 #include "httpclient.h"
+#include <time.h>
+#include <sys/epoll.h>
 
+/*
+ * Batch mode: fetch every URL of a list, at most conns_per_host at a time
+ * from each host, over keep-alive connections driven by one epoll loop.
+ */
+struct host;
+
+struct job {
+	struct host *host;
+	char *url;		/* as listed */
+	char *path;
+	int tries;
+	double start;		/* request sent */
+	struct job *next;
+};
+
+struct host {
+	char *name;		/* host[:port], also the Host header */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int nconns;
+	struct job *queue, **tail;	/* not yet started */
+};
+
+struct conn {
+	int fd;
+	struct host *host;
+	struct job *job;	/* in flight, or NULL while connecting */
+	int served;		/* responses done on fd */
+	size_t got;		/* bytes of job's response so far */
+	struct http_response resp;
+};
+
+static int conns_per_host = 4;
+static const char *mirror_dir;		/* save bodies below it, or NULL */
+static int devnull = -1;
+
+static struct host **hosts;
+static int nhosts;
+static double *latency;			/* of each completed fetch, ms */
+static int nlatency, nfailed, ndone;	/* fetches answered, failed, finished */
+static size_t nbytes;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct host *find_host(const char *name, size_t len)
+{
+	struct addrinfo hints, *res;
+	char node[256], *port;
+	struct host *h;
+	int i, err;
+
+	for (i = 0; i < nhosts; i++)
+		if (strlen(hosts[i]->name) == len &&
+		    strncmp(hosts[i]->name, name, len) == 0)
+			return hosts[i];
+	if (len >= sizeof(node))
+		return NULL;
+	memcpy(node, name, len);
+	node[len] = '\0';
+	port = strchr(node, ':');
+	if (port)
+		*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(node, port ? port : "http", &hints, &res)) != 0) {
+		fprintf(stderr, "%.*s: %s\n", (int) len, name,
+			gai_strerror(err));
+		return NULL;
+	}
+	h = calloc(1, sizeof(*h));
+	h->name = strndup(name, len);
+	memcpy(&h->addr, res->ai_addr, res->ai_addrlen);
+	h->addrlen = res->ai_addrlen;
+	h->tail = &h->queue;
+	freeaddrinfo(res);
+	hosts = realloc(hosts, (nhosts + 1) * sizeof(*hosts));
+	hosts[nhosts++] = h;
+	return h;
+}
+
+/* queue one line of the list: http://host[:port]/path or host[:port]/path */
+static int add_url(const char *url)
+{
+	const char *p, *slash;
+	struct job *job;
+	struct host *h;
+
+	p = strncmp(url, "http://", 7) == 0 ? url + 7 : url;
+	if ((slash = strchr(p, '/')) == NULL)
+		slash = p + strlen(p);
+	if (slash == p || (h = find_host(p, slash - p)) == NULL)
+		return -1;
+	job = calloc(1, sizeof(*job));
+	job->host = h;
+	job->url = strdup(url);
+	job->path = strdup(*slash ? slash : "/");
+	*h->tail = job;
+	h->tail = &job->next;
+	return 0;
+}
+
+static void requeue(struct job *job)
+{
+	struct host *h = job->host;
+
+	job->next = h->queue;
+	h->queue = job;
+	if (h->tail == &h->queue)
+		h->tail = &job->next;
+}
+
+static struct job *dequeue(struct host *h)
+{
+	struct job *job = h->queue;
+
+	if (job && (h->queue = job->next) == NULL)
+		h->tail = &h->queue;
+	return job;
+}
+
+/*
+ * dir/host/path, with the directories on the way created. The path is
+ * normalized as the server does it: empty and "." segments are dropped
+ * and ".." takes the segment before it off. A path that would climb out
+ * of dir/host fails with EINVAL.
+ */
+static int mirror_open(struct job *job)
+{
+	char name[4096], *p, *q, *base;
+	const char *s;
+	size_t len;
+	int n, dir;
+
+	n = snprintf(name, sizeof(name), "%s/%s", mirror_dir, job->host->name);
+	if (n >= sizeof(name))
+		goto toolong;
+	base = q = name + n;
+	dir = 1;	/* the path names a directory, save its index.html */
+	for (s = job->path; *(s += strspn(s, "/")) != '\0'; s += len) {
+		len = strcspn(s, "/");
+		dir = s[len] == '/';
+		if (len == 1 && s[0] == '.') {
+			dir = 1;
+		} else if (len == 2 && s[0] == '.' && s[1] == '.') {
+			if (q == base) {
+				errno = EINVAL;
+				return -1;
+			}
+			while (*--q != '/')
+				;
+			dir = 1;
+		} else {
+			if (len + 1 >= name + sizeof(name) - q)
+				goto toolong;
+			*q++ = '/';
+			memcpy(q, s, len);
+			q += len;
+		}
+	}
+	if (dir) {
+		if (sizeof("/index.html") > name + sizeof(name) - q)
+			goto toolong;
+		strcpy(q, "/index.html");
+	} else {
+		*q = '\0';
+	}
+
+	for (p = strchr(name + 1, '/'); p;
+	     p = strchr(p + 1, '/')) {
+		*p = '\0';
+		mkdir(name, 0755);
+		*p = '/';
+	}
+	return open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+toolong:
+	errno = ENAMETOOLONG;
+	return -1;
+}
+
+/* bodies go nowhere again, after a mirror file if there was one */
+static void sink_close(struct conn *c)
+{
+	if (c->resp.sink != devnull)
+		close(c->resp.sink);
+	http_response_sink(&c->resp, devnull);
+}
+
+static void job_done(struct conn *c, const char *err)
+{
+	struct job *job = c->job;
+
+	ndone++;
+	if (err) {
+		fprintf(stderr, "%s: %s\n", job->url, err);
+		nfailed++;
+	} else {
+		latency[nlatency++] = (now() - job->start) * 1e3;
+		if (c->resp.status >= 400) {
+			fprintf(stderr, "%s: status %d\n", job->url,
+				c->resp.status);
+			nfailed++;
+		}
+	}
+	sink_close(c);
+	free(job->url);
+	free(job->path);
+	free(job);
+	c->job = NULL;
+}
+
+/*
+ * The next job of c's host, with its mirror file as the sink, or NULL
+ * if there is none left. Jobs whose file can't be opened fail here.
+ */
+static struct job *next_job(struct conn *c)
+{
+	char err[256];
+	int fd;
+
+	while ((c->job = dequeue(c->host)) != NULL) {
+		if (mirror_dir == NULL)
+			return c->job;
+		if ((fd = mirror_open(c->job)) != -1) {
+			http_response_sink(&c->resp, fd);
+			return c->job;
+		}
+		snprintf(err, sizeof(err), "can't save to %s: %s", mirror_dir,
+			 strerror(errno));
+		job_done(c, err);
+	}
+	return NULL;
+}
+
+/* -1 if the request couldn't be sent, c is done for then */
+static int start_request(struct conn *c, struct job *job)
+{
+	c->job = job;
+	c->got = 0;
+	job->tries++;
+	http_response_reset(&c->resp);
+	job->start = now();
+	return http_request_handler(c->fd, "GET", job->path, job->host->name);
+}
+
+/* a new connection to h, its first request goes once it is up */
+static void open_conn(int epfd, struct host *h)
+{
+	struct epoll_event ev;
+	struct conn *c;
+
+	c = calloc(1, sizeof(*c));
+	c->host = h;
+	http_response_init(&c->resp);
+	c->resp.trace = NULL;
+	http_response_sink(&c->resp, devnull);
+	c->fd = socket(h->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->fd == -1)
+		err_sys("socket error");
+	if (connect(c->fd, (struct sockaddr *) &h->addr, h->addrlen) == -1 &&
+	    errno != EINPROGRESS)
+		err_sys("connect error");
+	ev.events = EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	h->nconns++;
+}
+
+/* done with c; another connection takes over if h has work left */
+static void close_conn(int epfd, struct conn *c)
+{
+	struct host *h = c->host;
+
+	close(c->fd);
+	http_response_free(&c->resp);
+	free(c);
+	h->nconns--;
+	if (h->queue && h->nconns < conns_per_host)
+		open_conn(epfd, h);
+}
+
+/* the server closed c or it failed; its request may be worth another go */
+static void conn_lost(int epfd, struct conn *c, const char *err)
+{
+	struct job *job = c->job;
+
+	if (job && c->got == 0 && c->served > 0 && job->tries < 2) {
+		sink_close(c);
+		requeue(job);	/* it closed an idle keep-alive connection */
+		c->job = NULL;
+	} else if (job) {
+		job_done(c, err);
+	}
+	close_conn(epfd, c);
+}
+
+static void conn_event(int epfd, struct conn *c)
+{
+	struct epoll_event ev;
+	const char *conn;
+	struct job *job;
+	socklen_t len;
+	ssize_t n;
+	int err;
+
+	if (c->job == NULL) {		/* connected, or not */
+		len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+			err = errno;
+		if (err) {
+			while (c->host->queue) {
+				c->job = dequeue(c->host);
+				job_done(c, strerror(err));
+			}
+			close_conn(epfd, c);
+			return;
+		}
+		if ((job = next_job(c)) == NULL) {	/* others took the work */
+			close_conn(epfd, c);
+			return;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+		if (start_request(c, job) == -1)
+			conn_lost(epfd, c, strerror(errno));
+		return;
+	}
+
+	while ((n = http_response_read(&c->resp, c->fd)) > 0) {
+		c->got += n;
+		nbytes += n;
+		if (http_response_done(&c->resp))
+			break;
+	}
+	if (n == -1 && errno == EAGAIN)
+		return;
+	/* a body without a length ends with the connection */
+	if (n == -1 || (n == 0 && !http_response_done(&c->resp))) {
+		conn_lost(epfd, c, n == 0 ? "connection closed" :
+			  strerror(errno));
+		return;
+	}
+
+	conn = map_get(&c->resp.map, H_CONNECTION);
+	job_done(c, NULL);
+	c->served++;
+	if (n == 0 || (conn && strcasecmp(conn, "close") == 0) ||
+	    (job = next_job(c)) == NULL)
+		close_conn(epfd, c);
+	else if (start_request(c, job) == -1)
+		conn_lost(epfd, c, strerror(errno));
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+	int i = (int) (p / 100 * nlatency + 0.5);
+
+	if (i >= nlatency)
+		i = nlatency - 1;
+	return latency[i];
+}
+
+static void batch(FILE *list)
+{
+	struct epoll_event evs[64];
+	char line[4096];
+	int epfd, njobs, i, n;
+	double start, secs;
+	size_t len;
+
+	njobs = 0;
+	while (fgets(line, sizeof(line), list)) {
+		len = strcspn(line, " \t\r\n");
+		line[len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		if (add_url(line) == -1)
+			fprintf(stderr, "%s: skipped\n", line);
+		else
+			njobs++;
+	}
+	if (njobs == 0)
+		err_exit("no URLs\n");
+	latency = malloc(njobs * sizeof(*latency));
+	if ((devnull = open("/dev/null", O_WRONLY)) == -1)
+		err_sys("/dev/null");
+	if ((epfd = epoll_create1(0)) == -1)
+		err_sys("epoll_create1 error");
+	signal(SIGPIPE, SIG_IGN);
+
+	start = now();
+	for (i = 0; i < nhosts; i++)
+		while (hosts[i]->queue && hosts[i]->nconns < conns_per_host)
+			open_conn(epfd, hosts[i]);
+	while (ndone < njobs) {
+		if ((n = epoll_wait(epfd, evs, 64, -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err_sys("epoll_wait error");
+		}
+		for (i = 0; i < n; i++)
+			conn_event(epfd, evs[i].data.ptr);
+	}
+	secs = now() - start;
+
+	qsort(latency, nlatency, sizeof(*latency), cmp_double);
+	printf("%d URLs from %d hosts in %.3f s, %d failed\n", njobs, nhosts,
+	       secs, nfailed);
+	printf("%.1f requests/s, %.2f MB/s\n", nlatency / secs,
+	       nbytes / secs / 1e6);
+	if (nlatency > 0)
+		printf("latency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+		       percentile(50), percentile(90), percentile(99),
+		       latency[nlatency - 1]);
+}
+
+/*
+ * usage: client [-o file] Host [url]
+ *        client -b list [-c conns] [-d dir]
+ *   -o  write the body to file instead of standard output
+ *   -b  fetch all URLs listed in file list ("-" for standard input),
+ *       one per line as http://host[:port]/path, and report throughput
+ *       and latency percentiles
+ *   -c  connections per host in batch mode, 4 by default
+ *   -d  save the bodies fetched in batch mode as dir/host/path
+ */
 int main(int argc, char *argv[])
 {
-	int sockfd;
-	const char *url, *host;
+	struct http_response resp;
+	int sockfd, opt, fd;
+	const char *url, *host, *list = NULL;
+	FILE *fp;
 
-	if (argc < 2 || argc > 3)
-		err_exit("Usage: client Host [url]\n");
+	http_response_init(&resp);
+	while ((opt = getopt(argc, argv, "o:b:c:d:")) != -1) {
+		switch (opt) {
+		case 'o':
+			fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1)
+				err_sys(optarg);
+			http_response_sink(&resp, fd);
+			break;
+		case 'b':
+			list = optarg;
+			break;
+		case 'c':
+			if ((conns_per_host = atoi(optarg)) < 1)
+				conns_per_host = 1;
+			break;
+		case 'd':
+			mirror_dir = optarg;
+			break;
+		default:
+			err_exit("Usage: client [-o file] Host [url]\n"
+				 "       client -b list [-c conns] [-d dir]\n");
+		}
+	}
+	if (list) {
+		fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+		if (fp == NULL)
+			err_sys(list);
+		batch(fp);
+		return nfailed > 0;
+	}
+	if (argc - optind < 1 || argc - optind > 2)
+		err_exit("Usage: client [-o file] Host [url]\n"
+			 "       client -b list [-c conns] [-d dir]\n");
 
-	sockfd = tcp_connect(argv[1]);
-	host = argv[1];
-	url = argv[2];
-	http_request_handler(sockfd, "GET", url, host);
-	http_response_handler(sockfd);
+	host = argv[optind];
+	url = argv[optind + 1];
+	sockfd = tcp_connect(host);
+	if (http_request_handler(sockfd, "GET", url, host) == -1)
+		err_sys("write error");
+	http_response_handler(&resp, sockfd);
+	http_response_free(&resp);
 	return 0;
 }
@@ -1,94 +1,198 @@
 #include "map.h"
+#include <stdint.h>
+#include <string.h>
 
-size_t s_size(struct m_string *s)
+#define INTERN_SLOTS 64
+
+static const struct {
+	const char *name;
+	size_t len;
+} interned[H_NIDS] = {
+#define N(id, s)	[id] = { s, sizeof(s) - 1 }
+	N(H_ACCEPT_RANGES, "accept-ranges"),
+	N(H_AGE, "age"),
+	N(H_CACHE_CONTROL, "cache-control"),
+	N(H_CONNECTION, "connection"),
+	N(H_CONTENT_ENCODING, "content-encoding"),
+	N(H_CONTENT_LENGTH, "content-length"),
+	N(H_CONTENT_TYPE, "content-type"),
+	N(H_DATE, "date"),
+	N(H_ETAG, "etag"),
+	N(H_EXPIRES, "expires"),
+	N(H_KEEP_ALIVE, "keep-alive"),
+	N(H_LAST_MODIFIED, "last-modified"),
+	N(H_LOCATION, "location"),
+	N(H_SERVER, "server"),
+	N(H_SET_COOKIE, "set-cookie"),
+	N(H_TRANSFER_ENCODING, "transfer-encoding"),
+	N(H_VARY, "vary"),
+#undef N
+};
+
+static unsigned intern_hash[H_NIDS];
+static unsigned char intern_slot[INTERN_SLOTS];	/* id, 0 if empty */
+
+/*
+ * Hash of the name as if lowercased, eight bytes at a time: names are
+ * tokens, in which setting bit 5 of every byte lowercases the letters.
+ */
+static unsigned name_hash(const char *p, size_t len)
 {
-	return s->size;
+	const uint64_t lc = 0x2020202020202020ull;
+	uint64_t h = len, w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ (w | lc)) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 32;
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, p, len);
+		h = (h ^ (w | (lc >> (64 - 8 * len)))) * 0x9e3779b97f4a7c15ull;
+	}
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ull;
+	return h ^ (h >> 32);
 }
 
-bool s_empty(struct m_string *s)
+static inline int lower(unsigned char c)
 {
-	return s->size == 0;
+	return c - 'A' < 26u ? c | 0x20 : c;
 }
 
-static struct map *pmalloc(size_t size, const char *key, const char *val)
+/* ASCII case-insensitive, unlike strncasecmp no locale to consult */
+static int name_eq(const char *a, const char *b, size_t len)
 {
-	struct map *ret = malloc(size);
+	while (len-- > 0)
+		if (lower(*a++) != lower(*b++))
+			return 0;
+	return 1;
+}
 
-	assert(ret != NULL);
+__attribute__((constructor))
+static void intern_init(void)
+{
+	unsigned i;
+	int id;
+
+	for (id = H_OTHER + 1; id < H_NIDS; id++) {
+		intern_hash[id] = name_hash(interned[id].name, interned[id].len);
+		for (i = intern_hash[id] % INTERN_SLOTS; intern_slot[i];
+		     i = (i + 1) % INTERN_SLOTS)
+			;
+		intern_slot[i] = id;
+	}
+}
+
+static int intern_find(const char *name, size_t len, unsigned h)
+{
+	unsigned i;
+	int id;
 
-	ret->first.size = strlen(key) + 1;
-	ret->first.data = malloc(ret->first.size);
+	for (i = h % INTERN_SLOTS; (id = intern_slot[i]) != 0;
+	     i = (i + 1) % INTERN_SLOTS)
+		if (intern_hash[id] == h && interned[id].len == len &&
+		    name_eq(name, interned[id].name, len))
+			return id;
+	return H_OTHER;
+}
 
-	ret->second.size = strlen(val) + 1;
-	ret->second.data = malloc(ret->second.size);
-	
-	strcpy(ret->first.data, key);	
-	strcpy(ret->second.data, val);
-	ret->left = ret->right = NULL;
+/* the id of a header name, H_OTHER if it isn't interned */
+int map_intern(const char *name, size_t len)
+{
+	return intern_find(name, len, name_hash(name, len));
+}
 
-	return ret;
+void map_init(struct map *map, struct arena *a)
+{
+	map->arena = a;
+	map->e = map->inline_e;
+	map->n = 0;
+	map->cap = sizeof(map->inline_e) / sizeof(map->inline_e[0]);
+	memset(map->byid, 0, sizeof(map->byid));
+	memset(map->slot, 0, sizeof(map->slot));
 }
 
-void map_insert(struct map *map_head, const char *key, const char *val)
+/* the index slot holding name, or the empty one where it would go */
+static unsigned find_slot(const struct map *map, const char *name,
+			  size_t len, unsigned h)
 {
-	struct map *x, *prev, *cur;
-	int sign;
-
-	prev = NULL;
-	cur = map_head;
-	sign = 0;
-
-	while (cur && (sign = strcmp(key, cur->first.data)) != 0) {
-		prev = cur;
-		if (sign < 0)
-			cur = cur->left;
-		else
-			cur = cur->right;
+	const struct map_entry *e;
+	unsigned i;
+
+	for (i = h % MAP_SLOTS; map->slot[i]; i = (i + 1) % MAP_SLOTS) {
+		e = &map->e[map->slot[i] - 1];
+		if (e->hash == h && e->nlen == len &&
+		    name_eq(e->name, name, len))
+			break;
 	}
-	
-	if (prev == NULL && cur == NULL) {
-		fprintf(stderr, "map_head is empty\n");
-		return;
+	return i;
+}
+
+/*
+ * Add a header, copying name and value into the arena. A repeated name
+ * replaces the earlier value. Returns -1 if the arena is out of memory
+ * or the table is full.
+ */
+int map_insert(struct map *map, const char *name, size_t nlen,
+	       const char *val, size_t vlen)
+{
+	struct map_entry *e;
+	unsigned h, i;
+	char *v;
+
+	h = name_hash(name, nlen);
+	i = find_slot(map, name, nlen, h);
+	if ((v = arena_strndup(map->arena, val, vlen)) == NULL)
+		return -1;
+	if (map->slot[i]) {
+		e = &map->e[map->slot[i] - 1];
+		e->value = v;
+		e->vlen = vlen;
+		return 0;
 	}
-	
-	if (cur == NULL) {
-		x = pmalloc(sizeof(struct map), key, val);
-		if (sign < 0)
-			prev->left = x;
-		else
-			prev->right = x;
-		return;
+	if (map->n == MAP_SLOTS - 1)	/* keep a slot free to end probes */
+		return -1;
+	if (map->n == map->cap) {
+		e = arena_alloc(map->arena, 2 * map->cap * sizeof(*e));
+		if (e == NULL)
+			return -1;
+		memcpy(e, map->e, map->n * sizeof(*e));
+		map->e = e;
+		map->cap *= 2;
 	}
-	free(cur->second.data);
-	cur->second.size = strlen(val) + 1;
-	cur->second.data = malloc(cur->second.size);
-	strcpy(cur->second.data, val);
+	e = &map->e[map->n];
+	if ((e->name = arena_strndup(map->arena, name, nlen)) == NULL)
+		return -1;
+	e->hash = h;
+	e->id = intern_find(name, nlen, h);
+	e->nlen = nlen;
+	e->value = v;
+	e->vlen = vlen;
+	map->slot[i] = ++map->n;
+	if (e->id != H_OTHER)
+		map->byid[e->id] = map->n;
+	return 0;
 }
 
-const char *map_at(struct map *map, const char *key)
+/* value of an interned header, NULL if absent */
+const char *map_get(const struct map *map, int id)
 {
-	struct map *cur;
-	int sign;
-	
-	cur = map;
-	while (cur && (sign = strcmp(key, cur->first.data)) != 0) {
-		if (sign < 0)
-			cur = cur->left;
-		else
-			cur = cur->right;
-	}
-	if (cur == NULL)
-		return NULL;
-	return cur->second.data;
+	int k = map->byid[id];
+
+	return k ? map->e[k - 1].value : NULL;
 }
 
-void map_destructor(struct map *map)
+const char *map_at(const struct map *map, const char *name)
 {
-	if (map) {
-		if (map->left)
-			map_destructor(map->left);
-		if (map->right)
-			map_destructor(map->right);
-		free(map);
-	}
+	size_t len = strlen(name);
+	unsigned h = name_hash(name, len);
+	unsigned i;
+	int id;
+
+	if ((id = intern_find(name, len, h)) != H_OTHER)
+		return map_get(map, id);
+	i = find_slot(map, name, len, h);
+	return map->slot[i] ? map->e[map->slot[i] - 1].value : NULL;
 }
@@ -1,27 +1,66 @@
 #ifndef MAP_H
 #define MAP_H
-#include <stdlib.h>
-#include <string.h>
-#include <stdbool.h>
-#include <assert.h>
-#include <stdio.h>
-
-struct m_string {
-	size_t size;
-	char *data;
+#include <stddef.h>
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Response headers in one flat array, names and values in an arena.
+ * Names are case-insensitive and hashed once on insert; the common ones
+ * are interned so looking them up is an index, not a string compare.
+ */
+enum map_id {
+	H_OTHER,		/* not interned */
+	H_ACCEPT_RANGES,
+	H_AGE,
+	H_CACHE_CONTROL,
+	H_CONNECTION,
+	H_CONTENT_ENCODING,
+	H_CONTENT_LENGTH,
+	H_CONTENT_TYPE,
+	H_DATE,
+	H_ETAG,
+	H_EXPIRES,
+	H_KEEP_ALIVE,
+	H_LAST_MODIFIED,
+	H_LOCATION,
+	H_SERVER,
+	H_SET_COOKIE,
+	H_TRANSFER_ENCODING,
+	H_VARY,
+	H_NIDS
 };
 
+struct map_entry {
+	unsigned hash;		/* of the lowercased name */
+	int id;
+	size_t nlen, vlen;
+	const char *name, *value;	/* NUL terminated */
+};
+
+#define MAP_SLOTS 128	/* name index, twice the entries we expect */
+
 struct map {
-	struct m_string first;
-	struct m_string second;
-	struct map *left, *right;
+	struct arena *arena;
+	struct map_entry *e;
+	int n, cap;
+	unsigned char byid[H_NIDS];	/* entry + 1 per interned id */
+	unsigned char slot[MAP_SLOTS];	/* entry + 1, open addressing */
+	struct map_entry inline_e[32];	/* e until there are more */
 };
 
-bool s_empty(struct m_string *s);
-size_t s_size(struct m_string *s);
+void map_init(struct map *map, struct arena *a);
+int map_intern(const char *name, size_t len);
+int map_insert(struct map *map, const char *name, size_t nlen,
+	       const char *val, size_t vlen);
+const char *map_get(const struct map *map, int id);
+const char *map_at(const struct map *map, const char *name);
 
-const char *map_at(struct map *map, const char *key);
-void map_insert(struct map *map_head, const char *key, const char *val);
-void map_destructor(struct map *map);
+#ifdef __cplusplus
+}
+#endif
 
 #endif
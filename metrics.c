@@ -0,0 +1,236 @@
+/*
+ * Per-worker counters in shared memory, added up into the Prometheus
+ * text format when /metrics is requested.
+ */
+#include "metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define load(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define store(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+static struct metrics fallback;	/* until metrics_init(), or if it fails */
+static struct metrics *slots = &fallback;
+static int nslots = 1;
+
+struct metrics *metrics_self = &fallback;
+int metrics_shared;
+
+static const int codes[MS_OTHER] = { 200, 400, 404, 414, 431, 500, 501 };
+
+/* upper bounds of the latency buckets, in microseconds and as labels */
+static const struct {
+	long us;
+	const char *le;
+} buckets[METRICS_LATENCY_BUCKETS] = {
+	{ 25, "0.000025" }, { 50, "0.00005" }, { 100, "0.0001" },
+	{ 250, "0.00025" }, { 500, "0.0005" }, { 1000, "0.001" },
+	{ 2500, "0.0025" }, { 5000, "0.005" }, { 10000, "0.01" },
+	{ 25000, "0.025" }, { 50000, "0.05" }, { 100000, "0.1" },
+	{ 250000, "0.25" }, { 500000, "0.5" }, { 1000000, "1" },
+	{ 2500000, "2.5" }, { 5000000, "5" }, { 10000000, "10" },
+};
+
+/*
+ * Map n slots shared with the processes forked from now on; shared if
+ * more than one process writes the same slot. Returns -1 if the mapping
+ * fails, counts then stay private to each process.
+ */
+int metrics_init(int n, int shared)
+{
+	void *p;
+
+	p = mmap(NULL, n * sizeof(struct metrics), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	slots = metrics_self = p;
+	nslots = n;
+	metrics_shared = shared;
+	return 0;
+}
+
+/*
+ * Count into slot id from now on. The connections a previous worker in
+ * the slot left open died with it, the totals carry on.
+ */
+void metrics_worker(int id)
+{
+	metrics_self = &slots[id % nslots];
+	store(&metrics_self->active, 0);
+}
+
+void metrics_accepted(void)
+{
+	metrics_add(&metrics_self->accepted, 1);
+	metrics_add(&metrics_self->active, 1);
+}
+
+void metrics_closed(void)
+{
+	metrics_add(&metrics_self->active, -1UL);
+}
+
+void metrics_request(int status)
+{
+	int i;
+
+	for (i = 0; i < MS_OTHER && codes[i] != status; i++)
+		;
+	metrics_add(&metrics_self->requests[i], 1);
+}
+
+void metrics_latency(long us)
+{
+	int i;
+
+	for (i = 0; i < METRICS_LATENCY_BUCKETS && us > buckets[i].us; i++)
+		;
+	metrics_add(&metrics_self->latency[i], 1);
+	metrics_add(&metrics_self->latency_sum, us);
+}
+
+/* publish this worker's hot content cache counters */
+void metrics_rcache(const struct rcache_stats *s)
+{
+	struct rcache_stats *m = &metrics_self->rcache;
+
+	store(&m->hits, s->hits);
+	store(&m->misses, s->misses);
+	store(&m->admitted, s->admitted);
+	store(&m->rejected, s->rejected);
+	store(&m->evicted, s->evicted);
+	store(&m->invalidated, s->invalidated);
+	store(&m->bytes, s->bytes);
+	store(&m->entries, s->entries);
+}
+
+/* every slot added up */
+static void sum(struct metrics *t)
+{
+	const struct metrics *m;
+	int i, j;
+
+	memset(t, 0, sizeof(*t));
+	for (i = 0; i < nslots; i++) {
+		m = &slots[i];
+		t->accepted += load(&m->accepted);
+		t->active += load(&m->active);
+		for (j = 0; j < MS_N; j++)
+			t->requests[j] += load(&m->requests[j]);
+		t->sent += load(&m->sent);
+		for (j = 0; j <= METRICS_LATENCY_BUCKETS; j++)
+			t->latency[j] += load(&m->latency[j]);
+		t->latency_sum += load(&m->latency_sum);
+		t->rcache.hits += load(&m->rcache.hits);
+		t->rcache.misses += load(&m->rcache.misses);
+		t->rcache.admitted += load(&m->rcache.admitted);
+		t->rcache.rejected += load(&m->rcache.rejected);
+		t->rcache.evicted += load(&m->rcache.evicted);
+		t->rcache.invalidated += load(&m->rcache.invalidated);
+		t->rcache.bytes += load(&m->rcache.bytes);
+		t->rcache.entries += load(&m->rcache.entries);
+	}
+}
+
+struct out {
+	char *p, *end;
+};
+
+static void put(struct out *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(o->p, o->end - o->p, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		o->p += n < o->end - o->p ? n : o->end - o->p - 1;
+}
+
+static void metric(struct out *o, const char *name, const char *type,
+		   const char *help)
+{
+	put(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Render the totals of all workers in the Prometheus text format into
+ * buf; returns the length, cut short if size is too small.
+ */
+size_t metrics_render(char *buf, size_t size)
+{
+	struct out o = { buf, buf + size };
+	struct metrics t;
+	unsigned long n, lookups;
+	int i;
+
+	if (size == 0)
+		return 0;
+	*buf = '\0';
+	sum(&t);
+	metric(&o, "httpd_connections_accepted_total", "counter",
+	       "Connections accepted.");
+	put(&o, "httpd_connections_accepted_total %lu\n", t.accepted);
+	metric(&o, "httpd_connections_active", "gauge",
+	       "Connections open now.");
+	put(&o, "httpd_connections_active %ld\n", (long) t.active);
+
+	metric(&o, "httpd_requests_total", "counter",
+	       "Requests answered, by status.");
+	for (i = 0; i < MS_OTHER; i++)
+		put(&o, "httpd_requests_total{code=\"%d\"} %lu\n", codes[i],
+		    t.requests[i]);
+	put(&o, "httpd_requests_total{code=\"other\"} %lu\n",
+	    t.requests[MS_OTHER]);
+	metric(&o, "httpd_sent_bytes_total", "counter",
+	       "Bytes sent, headers and bodies.");
+	put(&o, "httpd_sent_bytes_total %lu\n", t.sent);
+
+	metric(&o, "httpd_request_duration_seconds", "histogram",
+	       "From the first bytes of a request to the last of its "
+	       "response handed to the kernel.");
+	for (n = 0, i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+		n += t.latency[i];
+		put(&o, "httpd_request_duration_seconds_bucket{le=\"%s\"} %lu\n",
+		    buckets[i].le, n);
+	}
+	n += t.latency[METRICS_LATENCY_BUCKETS];
+	put(&o, "httpd_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n", n);
+	put(&o, "httpd_request_duration_seconds_sum %.6f\n",
+	    t.latency_sum / 1e6);
+	put(&o, "httpd_request_duration_seconds_count %lu\n", n);
+
+	metric(&o, "httpd_rcache_hits_total", "counter",
+	       "Hot content cache lookups that found a rendered response.");
+	put(&o, "httpd_rcache_hits_total %lu\n", t.rcache.hits);
+	metric(&o, "httpd_rcache_misses_total", "counter",
+	       "Hot content cache lookups that did not.");
+	put(&o, "httpd_rcache_misses_total %lu\n", t.rcache.misses);
+	metric(&o, "httpd_rcache_hit_ratio", "gauge",
+	       "Hits per lookup since the workers started.");
+	lookups = t.rcache.hits + t.rcache.misses;
+	put(&o, "httpd_rcache_hit_ratio %.4f\n",
+	    lookups ? (double) t.rcache.hits / lookups : 0.0);
+	metric(&o, "httpd_rcache_admitted_total", "counter",
+	       "Misses rendered and cached.");
+	put(&o, "httpd_rcache_admitted_total %lu\n", t.rcache.admitted);
+	metric(&o, "httpd_rcache_rejected_total", "counter",
+	       "Misses refused by the admission policy.");
+	put(&o, "httpd_rcache_rejected_total %lu\n", t.rcache.rejected);
+	metric(&o, "httpd_rcache_evicted_total", "counter",
+	       "Entries pushed out to make room.");
+	put(&o, "httpd_rcache_evicted_total %lu\n", t.rcache.evicted);
+	metric(&o, "httpd_rcache_invalidated_total", "counter",
+	       "Entries dropped because their file changed.");
+	put(&o, "httpd_rcache_invalidated_total %lu\n", t.rcache.invalidated);
+	metric(&o, "httpd_rcache_bytes", "gauge",
+	       "Size of the cached responses.");
+	put(&o, "httpd_rcache_bytes %zu\n", t.rcache.bytes);
+	metric(&o, "httpd_rcache_entries", "gauge", "Responses cached.");
+	put(&o, "httpd_rcache_entries %zu\n", t.rcache.entries);
+	return o.p - buf;
+}
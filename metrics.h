@@ -0,0 +1,74 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <time.h>
+#include "rcache.h"
+
+/*
+ * Server metrics. Every worker counts into its own slot of a shared
+ * mapping made before the workers are forked, so /metrics on any worker
+ * can add them all up. A slot has one writer and whole cache lines of
+ * its own: counting is a relaxed load and store, no lock and no locked
+ * instruction, and never bounces a line between CPUs. A reader may see
+ * a count a moment old, never a torn one. In the fork model all the
+ * connection processes share one slot and add atomically instead.
+ */
+
+#define METRICS_CACHELINE 64
+#define METRICS_LATENCY_BUCKETS 18
+#define METRICS_MAXBODY 8192	/* room for metrics_render() */
+
+/* the statuses we send, and everything else */
+enum {
+	MS_200, MS_400, MS_404, MS_414, MS_431, MS_500, MS_501, MS_OTHER,
+	MS_N
+};
+
+struct metrics {
+	unsigned long accepted;		/* connections */
+	unsigned long active;		/* connections open now, goes down too */
+	unsigned long requests[MS_N];	/* answered, by status */
+	unsigned long sent;		/* bytes, headers and bodies */
+	/* request latency in microseconds; the last bucket is +Inf */
+	unsigned long latency[METRICS_LATENCY_BUCKETS + 1];
+	unsigned long latency_sum;
+	struct rcache_stats rcache;	/* as of the worker's last lookup */
+} __attribute__ ((aligned(METRICS_CACHELINE)));
+
+extern struct metrics *metrics_self;	/* this process's slot */
+extern int metrics_shared;		/* the slot has other writers */
+
+static inline void metrics_add(unsigned long *p, unsigned long n)
+{
+	if (metrics_shared)
+		__atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+				 __ATOMIC_RELAXED);
+}
+
+static inline void metrics_sent(size_t n)
+{
+	metrics_add(&metrics_self->sent, n);
+}
+
+/* monotonic microseconds, for request latencies */
+static inline long metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int metrics_init(int nslots, int shared);
+void metrics_worker(int id);
+void metrics_accepted(void);
+void metrics_closed(void);
+void metrics_request(int status);
+void metrics_latency(long us);
+void metrics_rcache(const struct rcache_stats *s);
+size_t metrics_render(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,619 @@
+/*
+ * microbench - time the hot parsers and tables one at a time, on canned
+ * input, in the manner of Google Benchmark: every benchmark is run for
+ * more and more iterations until a run takes --benchmark_min_time, and
+ * that run is reported as time per iteration and, where the benchmark
+ * consumes input, bytes or items per second of CPU time.
+ *
+ *   happyhttp_pump/{length,chunked}/N   happyhttp::pump() on a whole
+ *       response with an N byte body, fed 64KB at a time like the
+ *       reactor receives it. Bodies are handed to the data callback
+ *       where they lie, so for big ones this is the framing's cost
+ *   httpclient_pump/{length,chunked}/N  the same for httpclient.c's
+ *       pump(), fed BUFSIZ at a time like http_response_read(); its
+ *       bodies go to /dev/null, it has nowhere else to put them
+ *   map_insert/N, map_at/N              N response headers into a map,
+ *       and every one of them looked up again
+ *   read_http_hdr_request/...           the server's request parser on a
+ *       few request headers, files served from an open file cache
+ *
+ * usage: microbench [--benchmark_filter=regex] [--benchmark_min_time=secs]
+ *                   [--benchmark_repetitions=n]
+ *                   [--benchmark_format=console|json]
+ *                   [--benchmark_out=file] [--benchmark_list_tests]
+ *
+ * The flags and the JSON written by --benchmark_format=json or to
+ * --benchmark_out are Google Benchmark's, so two builds can be compared
+ * with its tools/compare.py.
+ */
+#include "happyhttp.h"
+#include "httpclient.h"
+#include "map.h"
+#include "http.h"
+#include "scan.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <regex>
+#include <string>
+#include <vector>
+
+#define HAPPYHTTP_FEED	(64 * 1024)	// what the reactor receives at once
+#define CHUNK_SIZE	8192		// of chunked bodies
+#define MAX_ITERS	1000000000L
+
+struct Bench {
+	std::string name;
+	std::function<void(long)> run;	// the benchmark, n iterations of it
+	size_t bytes;			// consumed per iteration, or 0
+	size_t items;			// operations per iteration, or 0
+};
+
+struct Result {
+	std::string name;
+	const char *aggregate;		// NULL for a run
+	int rep;
+	long iters;
+	double real_ns, cpu_ns;		// per iteration
+	double bytes_per_sec, items_per_sec;
+};
+
+static std::vector<Bench> benches;
+static size_t sum;	// benchmarks add results here so they aren't optimized away
+
+// a typical origin response's headers, in the order servers send them
+static const char *headers[][2] = {
+	{ "Server", "nginx/1.25.3" },
+	{ "Date", "Thu, 15 Oct 2026 10:00:00 GMT" },
+	{ "Content-Type", "text/html; charset=utf-8" },
+	{ "Connection", "keep-alive" },
+	{ "Cache-Control", "private, max-age=0, must-revalidate" },
+	{ "ETag", "\"5f2b8c1e-bc55\"" },
+	{ "Last-Modified", "Wed, 14 Oct 2026 08:12:44 GMT" },
+	{ "Vary", "Accept-Encoding" },
+	{ "X-Request-Id", "7d9e3b2a-41c6-4f0e-9a8b-2c5d7e1f3a4b" },
+	{ "Strict-Transport-Security", "max-age=63072000" },
+	{ "X-Frame-Options", "SAMEORIGIN" },
+	{ "X-Content-Type-Options", "nosniff" },
+	{ "Referrer-Policy", "strict-origin-when-cross-origin" },
+	{ "Accept-Ranges", "bytes" },
+	{ "Age", "112" },
+	{ "Expires", "Thu, 15 Oct 2026 11:00:00 GMT" },
+	{ "X-Cache", "HIT" },
+	{ "X-Served-By", "cache-fra-etou8220049-FRA" },
+	{ "X-Timer", "S1697364000.123456,VS0,VE0" },
+	{ "Content-Security-Policy", "default-src 'self'" },
+	{ "Permissions-Policy", "interest-cohort=()" },
+	{ "Cross-Origin-Opener-Policy", "same-origin" },
+	{ "Cross-Origin-Resource-Policy", "same-origin" },
+	{ "Alt-Svc", "h3=\":443\"; ma=86400" },
+	{ "Via", "1.1 varnish" },
+	{ "X-Cache-Hits", "3" },
+	{ "NEL", "{\"report_to\":\"default\",\"max_age\":2592000}" },
+	{ "Report-To", "{\"group\":\"default\",\"max_age\":2592000}" },
+	{ "Server-Timing", "cdn-cache; desc=HIT, edge; dur=1" },
+	{ "Set-Cookie", "session=3c1f0a9e7b2d4c6a8e0f1b3d5c7a9e1f; Path=/" },
+};
+#define NHEADERS (sizeof(headers) / sizeof(headers[0]))
+#define RESPONSE_HEADERS 12	// the canned responses carry this many
+
+static const char *requests[][2] = {
+	{ "curl",
+	  "GET /index.html HTTP/1.1\r\n"
+	  "Host: localhost:8080\r\n"
+	  "User-Agent: curl/8.4.0\r\n"
+	  "Accept: */*\r\n"
+	  "\r\n" },
+	{ "browser",
+	  "GET /sub/page.html HTTP/1.1\r\n"
+	  "Host: www.example.com\r\n"
+	  "Connection: keep-alive\r\n"
+	  "sec-ch-ua: \"Chromium\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+	  "sec-ch-ua-mobile: ?0\r\n"
+	  "sec-ch-ua-platform: \"Linux\"\r\n"
+	  "Upgrade-Insecure-Requests: 1\r\n"
+	  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+	  "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+	  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	  "image/avif,image/webp,*/*;q=0.8\r\n"
+	  "Sec-Fetch-Site: same-origin\r\n"
+	  "Sec-Fetch-Mode: navigate\r\n"
+	  "Sec-Fetch-Dest: document\r\n"
+	  "Referer: http://www.example.com/index.html\r\n"
+	  "Accept-Encoding: gzip, deflate, br\r\n"
+	  "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+	  "Cookie: session=3c1f0a9e7b2d4c6a8e0f1b3d5c7a9e1f; theme=dark\r\n"
+	  "If-None-Match: \"5f2b8c1e-bc55\"\r\n"
+	  "\r\n" },
+	{ "escaped",
+	  "GET /sub/./old/../%70age%2Ehtml HTTP/1.1\r\n"
+	  "Host: localhost\r\n"
+	  "\r\n" },
+};
+
+static void die(const char *msg, const char *arg)
+{
+	fprintf(stderr, msg, arg);
+	exit(EXIT_FAILURE);
+}
+
+static double now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string make_response(size_t body, bool chunked)
+{
+	std::string s = "HTTP/1.1 200 OK\r\n";
+	char line[32];
+	size_t i, n;
+
+	for (i = 0; i < RESPONSE_HEADERS; i++)
+		s += std::string(headers[i][0]) + ": " + headers[i][1] + "\r\n";
+	if (!chunked) {
+		s += "Content-Length: " + std::to_string(body) + "\r\n\r\n";
+		s.append(body, 'x');
+		return s;
+	}
+	s += "Transfer-Encoding: chunked\r\n\r\n";
+	for (i = 0; i < body; i += n) {
+		n = std::min<size_t>(body - i, CHUNK_SIZE);
+		snprintf(line, sizeof(line), "%zx\r\n", n);
+		s += line;
+		s.append(n, 'x');
+		s += "\r\n";
+	}
+	s += "0\r\n\r\n";
+	return s;
+}
+
+static void happyhttp_data(const happyhttp::Response *r, void *userdata,
+			   const unsigned char *data, int n)
+{
+	*(size_t *) userdata += n;
+}
+
+// parse in, a whole response, iters times; returns the body bytes per
+// response
+static size_t happyhttp_pump(const std::string &in, long iters)
+{
+	happyhttp::Connection conn;
+	happyhttp::ArenaResource mr;
+	const unsigned char *p, *end;
+	size_t body = 0;
+	int n;
+
+	happyhttp::connection_init(&conn, "localhost", 80);
+	happyhttp::settrace(&conn, NULL);
+	happyhttp::setcallbacks(&conn, NULL, happyhttp_data, NULL, &body);
+	end = (const unsigned char *) in.data() + in.size();
+	for (long i = 0; i < iters; i++) {
+		// a Response lives and dies with its arena, as on a connection
+		void *mem = mr.allocate(sizeof(happyhttp::Response),
+					alignof(happyhttp::Response));
+		happyhttp::Response *r = new (mem) happyhttp::Response(&mr);
+
+		happyhttp::response_init(r, "GET", &conn);
+		for (p = (const unsigned char *) in.data(); p < end; p += n) {
+			n = std::min<ptrdiff_t>(end - p, HAPPYHTTP_FEED);
+			happyhttp::pump(r, p, n);
+		}
+		if (!happyhttp::completed(r))
+			die("%s", "happyhttp: canned response not complete\n");
+		sum += happyhttp::getstatus(r);
+		r->~Response();
+		arena_reset(&mr.m_Arena);
+	}
+	happyhttp::connection_destroy(&conn);
+	sum += body;
+	return body / iters;
+}
+
+static void httpclient_pump(const std::string &in, long iters)
+{
+	static struct http_response r;
+	const char *p, *end;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1)
+		err_sys("/dev/null");
+	http_response_init(&r);
+	http_response_sink(&r, fd);
+	r.trace = NULL;
+	end = in.data() + in.size();
+	for (long i = 0; i < iters; i++) {
+		http_response_reset(&r);
+		for (p = in.data(); p < end; p += n) {
+			n = std::min<ptrdiff_t>(end - p, BUFSIZ);
+			pump(&r, p, n);
+		}
+		if (!http_response_done(&r))
+			die("%s", "httpclient: canned response not complete\n");
+		sum += r.status;
+	}
+	http_response_free(&r);
+	close(fd);
+}
+
+static void map_fill(struct map *map, struct arena *a, size_t n)
+{
+	arena_reset(a);
+	map_init(map, a);
+	for (size_t i = 0; i < n; i++)
+		map_insert(map, headers[i][0], strlen(headers[i][0]),
+			   headers[i][1], strlen(headers[i][1]));
+}
+
+static void bench_map_insert(size_t n, long iters)
+{
+	struct arena a = { 0 };
+	struct map map;
+
+	for (long i = 0; i < iters; i++) {
+		map_fill(&map, &a, n);
+		sum += map.n;
+	}
+	arena_free(&a);
+}
+
+static void bench_map_at(size_t n, long iters)
+{
+	struct arena a = { 0 };
+	struct map map;
+	const char *v;
+
+	map_fill(&map, &a, n);
+	for (long i = 0; i < iters; i++) {
+		for (size_t j = 0; j < n; j++)
+			if ((v = map_at(&map, headers[j][0])) != NULL)
+				sum += (unsigned char) *v;
+	}
+	arena_free(&a);
+}
+
+static int parse_request(const char *req, size_t len)
+{
+	struct httphdr_request hdr;
+	struct fcache_entry *file;
+	int status;
+
+	http_request_init(&hdr);
+	if ((status = read_http_hdr_request(&hdr, req, len, &file)) == 200)
+		fcache_put(file);
+	sum += hdr.hdrlen;
+	return status;
+}
+
+// a www/ for read_http_hdr_request() to find the requested files in
+static char wwwroot[] = "/tmp/microbench.XXXXXX";
+
+static void www_file(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+	    write(fd, "<html></html>\n", 14) != 14)
+		die("%s: cannot create\n", path);
+	close(fd);
+}
+
+static void www_cleanup(void)
+{
+	unlink("www/sub/page.html");
+	unlink("www/index.html");
+	rmdir("www/sub");
+	rmdir("www");
+	if (chdir("/") == 0)
+		rmdir(wwwroot);
+}
+
+static void www_setup(void)
+{
+	if (mkdtemp(wwwroot) == NULL || chdir(wwwroot) == -1)
+		die("%s: cannot set up\n", wwwroot);
+	atexit(www_cleanup);
+	if (mkdir("www", 0755) == -1 || mkdir("www/sub", 0755) == -1)
+		die("%s: cannot set up\n", wwwroot);
+	www_file("www/index.html");
+	www_file("www/sub/page.html");
+	if (fcache_init(64) == -1)
+		die("%s", "fcache_init failed\n");
+}
+
+static void register_benches(void)
+{
+	static const size_t bodies[] = { 0, 1024, 65536, 1 << 20 };
+	static const size_t nheaders[] = { 10, 20, 30 };
+
+	for (size_t body : bodies) {
+		for (bool chunked : { false, true }) {
+			std::string in = make_response(body, chunked);
+			std::string kind = chunked ? "/chunked/" : "/length/";
+			std::string size = std::to_string(body);
+
+			if (happyhttp_pump(in, 1) != body)
+				die("%s", "happyhttp: wrong body length\n");
+			httpclient_pump(in, 1);
+			benches.push_back({ "happyhttp_pump" + kind + size,
+				[in](long n) { happyhttp_pump(in, n); },
+				in.size(), 0 });
+			benches.push_back({ "httpclient_pump" + kind + size,
+				[in](long n) { httpclient_pump(in, n); },
+				in.size(), 0 });
+		}
+	}
+	for (size_t n : nheaders) {
+		benches.push_back({ "map_insert/" + std::to_string(n),
+			[n](long iters) { bench_map_insert(n, iters); }, 0, n });
+		benches.push_back({ "map_at/" + std::to_string(n),
+			[n](long iters) { bench_map_at(n, iters); }, 0, n });
+	}
+	for (auto &rq : requests) {
+		const char *req = rq[1];
+		size_t len = strlen(req);
+
+		if (parse_request(req, len) != 200)
+			die("read_http_hdr_request: %s not served\n", rq[0]);
+		benches.push_back({ std::string("read_http_hdr_request/") + rq[0],
+			[req, len](long iters) {
+				for (long i = 0; i < iters; i++)
+					parse_request(req, len);
+			}, len, 0 });
+	}
+}
+
+// Run b for more iterations each time, as Google Benchmark does, until
+// a run takes min_time; that one counts.
+static Result measure(const Bench &b, double min_time)
+{
+	Result res = { b.name, NULL, 0 };
+	double real, cpu, mult;
+	long iters = 1;
+
+	for (;;) {
+		real = now(CLOCK_MONOTONIC);
+		cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+		b.run(iters);
+		real = now(CLOCK_MONOTONIC) - real;
+		cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+		if (real >= min_time || iters >= MAX_ITERS)
+			break;
+		mult = real > 0 ? min_time * 1.4 / real : 10;
+		iters = std::min<long>(MAX_ITERS, std::max<long>(iters + 1,
+			iters * std::min(mult, 10.0)));
+	}
+	res.iters = iters;
+	res.real_ns = real * 1e9 / iters;
+	res.cpu_ns = cpu * 1e9 / iters;
+	res.bytes_per_sec = cpu > 0 ? (double) b.bytes * iters / cpu : 0;
+	res.items_per_sec = cpu > 0 ? (double) b.items * iters / cpu : 0;
+	return res;
+}
+
+// mean, median and stddev of the repetitions of one benchmark
+static void aggregate(std::vector<Result> &out, size_t first)
+{
+	static const char *names[] = { "mean", "median", "stddev" };
+	std::vector<Result> reps(out.begin() + first, out.end());
+	size_t n = reps.size();
+
+	for (int k = 0; k < 3; k++) {
+		Result a = reps[0];
+
+		a.aggregate = names[k];
+		a.name = reps[0].name + "_" + names[k];
+		a.rep = 0;
+		a.iters = n;
+		auto stat = [&](double Result::*f) {
+			std::vector<double> v;
+			double m = 0, d = 0;
+
+			for (auto &r : reps)
+				v.push_back(r.*f);
+			for (double x : v)
+				m += x / n;
+			if (k == 1) {
+				std::sort(v.begin(), v.end());
+				return n % 2 ? v[n / 2] :
+					(v[n / 2 - 1] + v[n / 2]) / 2;
+			}
+			if (k == 0)
+				return m;
+			for (double x : v)
+				d += (x - m) * (x - m);
+			return n > 1 ? sqrt(d / (n - 1)) : 0.0;
+		};
+		a.real_ns = stat(&Result::real_ns);
+		a.cpu_ns = stat(&Result::cpu_ns);
+		a.bytes_per_sec = stat(&Result::bytes_per_sec);
+		a.items_per_sec = stat(&Result::items_per_sec);
+		out.push_back(a);
+	}
+}
+
+static std::string human(double v)
+{
+	static const char units[] = " kMGT";
+	char buf[32];
+	int i;
+
+	for (i = 0; v >= 1000 && i < 4; i++)
+		v /= 1000;
+	snprintf(buf, sizeof(buf), i ? "%.4g%c" : "%.4g", v, units[i]);
+	return buf;
+}
+
+static void print_console(FILE *fp, const Result &r, int width)
+{
+	fprintf(fp, "%-*s %12.1f ns %12.1f ns %12ld", width, r.name.c_str(),
+		r.real_ns, r.cpu_ns, r.iters);
+	if (r.bytes_per_sec > 0)
+		fprintf(fp, " bytes_per_second=%sB/s",
+			human(r.bytes_per_sec).c_str());
+	if (r.items_per_sec > 0)
+		fprintf(fp, " items_per_second=%s/s",
+			human(r.items_per_sec).c_str());
+	fputc('\n', fp);
+	fflush(fp);
+}
+
+static void print_json(FILE *fp, const std::vector<Result> &results,
+		       const char *argv0, int reps)
+{
+	char date[64], host[256];
+	time_t t = time(NULL);
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &tm);
+	if (gethostname(host, sizeof(host)) == -1)
+		strcpy(host, "unknown");
+	fprintf(fp, "{\n  \"context\": {\n"
+		"    \"date\": \"%s\",\n"
+		"    \"host_name\": \"%s\",\n"
+		"    \"executable\": \"%s\",\n"
+		"    \"num_cpus\": %ld,\n"
+		"    \"scan_kernel\": \"%s\",\n"
+		"    \"library_build_type\": \"%s\"\n"
+		"  },\n  \"benchmarks\": [",
+		date, host, argv0, sysconf(_SC_NPROCESSORS_ONLN),
+		scan_name(scan_select(SCAN_AVX2)),
+#ifdef NDEBUG
+		"release"
+#else
+		"debug"
+#endif
+		);
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		std::string run = r.aggregate ?
+			r.name.substr(0, r.name.rfind('_')) : r.name;
+
+		fprintf(fp, "%s\n    {\n"
+			"      \"name\": \"%s\",\n"
+			"      \"run_name\": \"%s\",\n"
+			"      \"run_type\": \"%s\",\n"
+			"      \"repetitions\": %d,\n",
+			i ? "," : "", r.name.c_str(), run.c_str(),
+			r.aggregate ? "aggregate" : "iteration", reps);
+		if (r.aggregate)
+			fprintf(fp, "      \"aggregate_name\": \"%s\",\n",
+				r.aggregate);
+		else
+			fprintf(fp, "      \"repetition_index\": %d,\n", r.rep);
+		fprintf(fp, "      \"threads\": 1,\n"
+			"      \"iterations\": %ld,\n"
+			"      \"real_time\": %.6e,\n"
+			"      \"cpu_time\": %.6e,\n"
+			"      \"time_unit\": \"ns\"", r.iters,
+			r.real_ns, r.cpu_ns);
+		if (r.bytes_per_sec > 0)
+			fprintf(fp, ",\n      \"bytes_per_second\": %.6e",
+				r.bytes_per_sec);
+		if (r.items_per_sec > 0)
+			fprintf(fp, ",\n      \"items_per_second\": %.6e",
+				r.items_per_sec);
+		fprintf(fp, "\n    }");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+}
+
+static const char *flag(const char *arg, const char *name)
+{
+	size_t n = strlen(name);
+
+	if (strncmp(arg, "--", 2) == 0 && strncmp(arg + 2, name, n) == 0 &&
+	    arg[2 + n] == '=')
+		return arg + 3 + n;
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filter = ".", *format = "console", *out = NULL, *v;
+	double min_time = 0.5;
+	int reps = 1, list = 0, width = 10;
+	std::vector<Result> results;
+	FILE *fp = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if ((v = flag(argv[i], "benchmark_filter")))
+			filter = v;
+		else if ((v = flag(argv[i], "benchmark_min_time")))
+			min_time = atof(v);	// "0.5" or "0.5s"
+		else if ((v = flag(argv[i], "benchmark_repetitions")))
+			reps = std::max(atoi(v), 1);
+		else if ((v = flag(argv[i], "benchmark_format")))
+			format = v;
+		else if ((v = flag(argv[i], "benchmark_out")))
+			out = v;
+		else if (strcmp(argv[i], "--benchmark_list_tests") == 0)
+			list = 1;
+		else
+			die("usage: %s [--benchmark_filter=regex] "
+			    "[--benchmark_min_time=secs]\n"
+			    "\t[--benchmark_repetitions=n] "
+			    "[--benchmark_format=console|json]\n"
+			    "\t[--benchmark_out=file] [--benchmark_list_tests]\n",
+			    argv[0]);
+	}
+	if (strcmp(format, "console") != 0 && strcmp(format, "json") != 0)
+		die("%s: unknown format\n", format);
+	if (out && (fp = fopen(out, "w")) == NULL)
+		die("%s: cannot write\n", out);
+
+	www_setup();
+	register_benches();
+	std::regex re(filter);
+	std::vector<Bench> run;
+	for (auto &b : benches)
+		if (std::regex_search(b.name, re))
+			run.push_back(b);
+	for (auto &b : run) {
+		if (list)
+			printf("%s\n", b.name.c_str());
+		width = std::max<int>(width, b.name.size() + 8);
+	}
+	if (list)
+		return 0;
+
+	bool console = strcmp(format, "console") == 0;
+	if (console)
+		printf("%-*s %15s %15s %12s\n%s\n", width, "Benchmark", "Time",
+		       "CPU", "Iterations", std::string(width + 57, '-').c_str());
+	for (auto &b : run) {
+		size_t first = results.size();
+
+		for (int rep = 0; rep < reps; rep++) {
+			results.push_back(measure(b, min_time));
+			results.back().rep = rep;
+			if (console)
+				print_console(stdout, results.back(), width);
+		}
+		if (reps > 1) {
+			aggregate(results, first);
+			for (size_t i = results.size() - 3; console &&
+			     i < results.size(); i++)
+				print_console(stdout, results[i], width);
+		}
+	}
+	if (!console)
+		print_json(stdout, results, argv[0], reps);
+	if (fp) {
+		print_json(fp, results, argv[0], reps);
+		fclose(fp);
+	}
+	return sum == 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Hot content cache: fully rendered responses for small, popular files,
+ * so a hit is one writev() with no file I/O at all. The cache is bounded
+ * by a byte budget and guarded by TinyLFU admission: a count-min sketch
+ * estimates how often each file was requested recently, and a new
+ * response only gets in if its file is requested more often than the
+ * least recently used entry it would displace. One-hit wonders thus
+ * never push out the hot set.
+ *
+ * Entries hang off their fcache entry; fcache calls rcache_drop() when
+ * the file changes or leaves the open file cache.
+ */
+#include "rcache.h"
+#include "http.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SKETCH_ROWS	4
+#define SKETCH_WIDTH	4096	/* counters per row, power of two */
+#define SKETCH_MAX	15	/* counters saturate like 4-bit ones */
+
+static size_t budget, maxobj;
+static struct rcache_entry lru = { .prev = &lru, .next = &lru };
+static struct rcache_stats stats;
+
+static unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+static unsigned long samples;	/* increments since the sketch was aged */
+
+static unsigned sketch_index(unsigned h, int row)
+{
+	static const unsigned seed[SKETCH_ROWS] = {
+		0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+	};
+
+	h = (h ^ (h >> 16)) * seed[row];
+	return (h ^ (h >> 15)) & (SKETCH_WIDTH - 1);
+}
+
+static int sketch_estimate(unsigned h)
+{
+	int i, n, min;
+
+	min = SKETCH_MAX;
+	for (i = 0; i < SKETCH_ROWS; i++)
+		if ((n = sketch[i][sketch_index(h, i)]) < min)
+			min = n;
+	return min;
+}
+
+/* conservative update: only bump the counters holding the minimum */
+static void sketch_add(unsigned h)
+{
+	int i, j, min;
+
+	min = sketch_estimate(h);
+	if (min < SKETCH_MAX)
+		for (i = 0; i < SKETCH_ROWS; i++)
+			if (sketch[i][sketch_index(h, i)] == min)
+				sketch[i][sketch_index(h, i)]++;
+
+	/* age: halve everything once per sample period, so stale hot
+	 * files lose their standing */
+	if (++samples == 10 * SKETCH_WIDTH) {
+		for (i = 0; i < SKETCH_ROWS; i++)
+			for (j = 0; j < SKETCH_WIDTH; j++)
+				sketch[i][j] >>= 1;
+		samples = 0;
+	}
+}
+
+/* cache up to budget bytes of responses for files of at most maxobj bytes */
+int rcache_init(size_t b, size_t m)
+{
+	budget = b;
+	maxobj = m;
+	return 0;
+}
+
+const struct rcache_stats *rcache_stats(void)
+{
+	return &stats;
+}
+
+static void unlink_entry(struct rcache_entry *r)
+{
+	r->prev->next = r->next;
+	r->next->prev = r->prev;
+	r->file->resp = NULL;
+	stats.bytes -= sizeof(*r) + r->len;
+	stats.entries--;
+	rcache_put(r);
+}
+
+void rcache_put(struct rcache_entry *r)
+{
+	if (--r->refs == 0) {
+		fcache_put(r->file);
+		free(r);
+	}
+}
+
+/* the file changed or left the open file cache */
+void rcache_drop(struct fcache_entry *f)
+{
+	if (f->resp) {
+		unlink_entry(f->resp);
+		stats.invalidated++;
+	}
+}
+
+static struct rcache_entry *render(struct fcache_entry *f)
+{
+	struct httphdr_response hdr;
+	struct iovec iov[HTTP_HDR_IOVMAX];
+	struct rcache_entry *r;
+	size_t hdrlen, off;
+	ssize_t n;
+	int i, cnt;
+
+	fill_http_hdr_response(&hdr, 200, f->size, f, 1);
+	cnt = build_http_hdr_response(&hdr, iov, HDR_FIXED);
+	for (hdrlen = 0, i = 0; i < cnt; i++)
+		hdrlen += iov[i].iov_len;
+	r = malloc(sizeof(*r) + hdrlen + 2 + f->size);
+	if (r == NULL)
+		return NULL;
+	for (off = 0, i = 0; i < cnt; off += iov[i++].iov_len)
+		memcpy(r->data + off, iov[i].iov_base, iov[i].iov_len);
+	memcpy(r->data + hdrlen, "\r\n", 2);
+	for (off = 0; off < f->size; off += n) {
+		n = pread(f->fd, r->data + hdrlen + 2 + off, f->size - off, off);
+		if (n <= 0) {
+			free(r);
+			return NULL;
+		}
+	}
+	r->file = f;
+	f->refs++;
+	r->refs = 1;
+	r->hdrlen = hdrlen;
+	r->len = hdrlen + 2 + f->size;
+	return r;
+}
+
+/*
+ * Return the rendered response for f with a reference the caller must
+ * drop with rcache_put(), or NULL if f is not (and should not be)
+ * cached; the caller then sends the file itself.
+ */
+struct rcache_entry *rcache_get(struct fcache_entry *f)
+{
+	struct rcache_entry *r, *v;
+	size_t need, freed;
+	int freq;
+
+	if (budget == 0 || f->size > maxobj)
+		return NULL;
+	sketch_add(f->hash);
+
+	if ((r = f->resp) != NULL) {
+		stats.hits++;
+		r->prev->next = r->next;
+		r->next->prev = r->prev;
+		goto push;
+	}
+	stats.misses++;
+	if (f->wd == -1)	/* not in the open file cache, can't track it */
+		return NULL;
+
+	/*
+	 * TinyLFU: make room only if the file is requested more often than
+	 * every victim it would push out; otherwise leave the cache alone.
+	 */
+	need = sizeof(*r) + f->size + 512;
+	freq = sketch_estimate(f->hash);
+	freed = 0;
+	for (v = lru.prev; stats.bytes - freed + need > budget; v = v->prev) {
+		if (v == &lru || sketch_estimate(v->file->hash) >= freq) {
+			stats.rejected++;
+			return NULL;
+		}
+		freed += sizeof(*v) + v->len;
+	}
+	while (lru.prev != v) {
+		unlink_entry(lru.prev);
+		stats.evicted++;
+	}
+	if ((r = render(f)) == NULL)
+		return NULL;
+	f->resp = r;
+	stats.admitted++;
+	stats.bytes += sizeof(*r) + r->len;
+	stats.entries++;
+push:
+	r->next = lru.next;
+	r->prev = &lru;
+	lru.next->prev = r;
+	lru.next = r;
+	r->refs++;
+	return r;
+}
@@ -0,0 +1,38 @@
+#ifndef RCACHE_H
+#define RCACHE_H
+
+#include <stddef.h>
+#include "fcache.h"
+
+/*
+ * A complete 200 response for a small file, rendered once: the status
+ * line and fixed headers, then the empty line and the body, in one
+ * buffer. Date and Connection go in between when it is sent.
+ */
+struct rcache_entry {
+	struct fcache_entry *file;	/* the file this was rendered from */
+	int refs;	/* connections sending it, +1 while cached */
+	size_t hdrlen;			/* data[0, hdrlen): header lines */
+	size_t len;			/* data[hdrlen, len): "\r\n" and body */
+	struct rcache_entry *prev, *next;	/* LRU list, newest first */
+	char data[];
+};
+
+struct rcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long admitted;	/* misses that were rendered and cached */
+	unsigned long rejected;	/* misses refused by the admission policy */
+	unsigned long evicted;	/* entries pushed out to make room */
+	unsigned long invalidated; /* entries dropped because the file changed */
+	size_t bytes;		/* current size of all entries */
+	size_t entries;
+};
+
+int rcache_init(size_t budget, size_t maxobj);
+struct rcache_entry *rcache_get(struct fcache_entry *f);
+void rcache_put(struct rcache_entry *r);
+void rcache_drop(struct fcache_entry *f);
+const struct rcache_stats *rcache_stats(void);
+
+#endif
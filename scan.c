@@ -0,0 +1,204 @@
+#include "scan.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef const char *(*scan_fn)(const char *p, const char *end);
+
+static const unsigned char delim[256] = {
+	[':'] = 1, [' '] = 1, ['\t'] = 1, ['\r'] = 1, ['\n'] = 1,
+};
+
+static const char *eol_scalar(const char *p, const char *end)
+{
+	while (p < end && *p != '\n')
+		p++;
+	return p;
+}
+
+static const char *delim_scalar(const char *p, const char *end)
+{
+	while (p < end && !delim[(unsigned char) *p])
+		p++;
+	return p;
+}
+
+#ifdef SCAN_X86
+/*
+ * Most lines are shorter than a vector, so the last partial block is
+ * loaded whole when that cannot fault, i.e. it stays within the page,
+ * and matches past end are masked off.
+ */
+#define PAGE_SIZE 4096
+#define tail_ok(p, width) \
+	(((uintptr_t) (p) & (PAGE_SIZE - 1)) <= PAGE_SIZE - (width))
+
+__attribute__((target("sse4.2")))
+static const char *eol_sse42(const char *p, const char *end)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	unsigned mask;
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	if (p == end || !tail_ok(p, 16))
+		return eol_scalar(p, end);
+	mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *) p), nl));
+	mask &= (1u << (end - p)) - 1;
+	return mask ? p + __builtin_ctz(mask) : end;
+}
+
+__attribute__((target("sse4.2")))
+static const char *delim_sse42(const char *p, const char *end)
+{
+	const __m128i set = _mm_setr_epi8(':', ' ', '\t', '\r', '\n',
+					  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	int i;
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+
+		i = _mm_cmpestri(set, 5, v, 16, _SIDD_UBYTE_OPS |
+				 _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+		if (i < 16)
+			return p + i;
+	}
+	if (p == end || !tail_ok(p, 16))
+		return delim_scalar(p, end);
+	/* the explicit length ignores the bytes past end */
+	i = _mm_cmpestri(set, 5, _mm_loadu_si128((const __m128i *) p), end - p,
+			 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+			 _SIDD_LEAST_SIGNIFICANT);
+	return i < 16 ? p + i : end;
+}
+
+__attribute__((target("avx2")))
+static const char *eol_avx2(const char *p, const char *end)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	unsigned mask;
+
+	/* short lines are common, try a half width block first */
+	if (end - p >= 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *) p),
+				_mm256_castsi256_si128(nl)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	if (p == end || !tail_ok(p, 32))
+		return eol_sse42(p, end);
+	mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *) p), nl));
+	mask &= (1u << (end - p)) - 1;
+	return mask ? p + __builtin_ctz(mask) : end;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned delim_mask(const char *p)
+{
+	const __m256i v = _mm256_loadu_si256((const __m256i *) p);
+	__m256i m;
+
+	m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+			    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+	return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static const char *delim_avx2(const char *p, const char *end)
+{
+	const __m128i set = _mm_setr_epi8(':', ' ', '\t', '\r', '\n',
+					  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	unsigned mask;
+	int i;
+
+	/* header names are mostly short, try a half width block first */
+	if (end - p >= 16) {
+		i = _mm_cmpestri(set, 5, _mm_loadu_si128((const __m128i *) p),
+				 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+				 _SIDD_LEAST_SIGNIFICANT);
+		if (i < 16)
+			return p + i;
+		p += 16;
+	}
+	for (; end - p >= 32; p += 32)
+		if ((mask = delim_mask(p)) != 0)
+			return p + __builtin_ctz(mask);
+	if (p == end || !tail_ok(p, 32))
+		return delim_sse42(p, end);
+	mask = delim_mask(p) & ((1u << (end - p)) - 1);
+	return mask ? p + __builtin_ctz(mask) : end;
+}
+#endif
+
+static scan_fn eol_fn = eol_scalar;
+static scan_fn delim_fn = delim_scalar;
+
+int scan_select(int level)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (level >= SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+		eol_fn = eol_avx2;
+		delim_fn = delim_avx2;
+		return SCAN_AVX2;
+	}
+	if (level >= SCAN_SSE42 && __builtin_cpu_supports("sse4.2")) {
+		eol_fn = eol_sse42;
+		delim_fn = delim_sse42;
+		return SCAN_SSE42;
+	}
+#endif
+	eol_fn = eol_scalar;
+	delim_fn = delim_scalar;
+	return SCAN_SCALAR;
+}
+
+const char *scan_name(int level)
+{
+	static const char *names[] = { "scalar", "sse4.2", "avx2" };
+
+	return level >= 0 && level <= SCAN_AVX2 ? names[level] : "?";
+}
+
+/*
+ * Pick the kernels at load time, before any thread can call them, so
+ * they are only ever read afterwards.
+ */
+__attribute__((constructor))
+static void scan_init(void)
+{
+	scan_select(SCAN_AVX2);
+}
+
+const char *scan_eol(const char *p, const char *end)
+{
+	return eol_fn(p, end);
+}
+
+const char *scan_delim(const char *p, const char *end)
+{
+	return delim_fn(p, end);
+}
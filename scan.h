@@ -0,0 +1,39 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+ * Delimiter scanning shared by the server's request parser and the
+ * clients' response parsers. The kernel is picked once at runtime from
+ * what the CPU supports: AVX2 looks at 32 bytes per step, SSE4.2 at 16,
+ * and the scalar one at a byte at a time.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum scan_level {
+	SCAN_SCALAR,
+	SCAN_SSE42,
+	SCAN_AVX2,
+};
+
+/* first '\n' in [p, end), or end */
+const char *scan_eol(const char *p, const char *end);
+
+/* first ':', ' ', '\t', '\r' or '\n' in [p, end), or end */
+const char *scan_delim(const char *p, const char *end);
+
+/*
+ * Use at most the given kernel, as far as the CPU supports it; returns
+ * the one selected. Without a call the best available is used. Not safe
+ * while other threads are scanning.
+ */
+int scan_select(int level);
+const char *scan_name(int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
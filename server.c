@@ -1,43 +1,176 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
 
 #include "http.h"
+#include "rcache.h"
+#include "metrics.h"
+#include "uring.h"
+
+#define MAXEVENTS 256
+#define FCACHE_ENTRIES 1024	/* open files cached per event loop */
+#define RCACHE_MAXOBJ (64 << 10) /* largest file kept as rendered response */
+#define URING_ENTRIES 1024	/* submission queue size */
+#define URING_NBUFS 512		/* recv buffers shared by all connections */
+#define URING_BUFSIZE 4096
+#define URING_WBUFSIZE (64 << 10) /* file data read per send */
+
+/* per-connection state, advanced by http_request_handler() */
+enum conn_state {
+	CONN_READ,		/* receiving the request header */
+	CONN_WRITE_HDR,		/* sending the header, or a cached response */
+	CONN_WRITE_BODY,	/* sending the file */
+	CONN_LINGER,		/* half-closed, draining what the client sent */
+	CONN_CLOSE,		/* done, connection should be closed */
+};
+
+struct link {
+	struct link *prev, *next;
+};
+
+struct conn {
+	struct link idle;	/* must be first: event loop idle list */
+	time_t last;		/* last activity, for the idle timeout */
+	int fd;
+	struct fcache_entry *file;	/* file being sent, NULL if none */
+	enum conn_state state;
+	int keepalive;		/* keep the connection after this response */
+	int nreq;		/* requests answered on this connection */
+	struct httphdr_request req;	/* the request being parsed/answered */
+	struct rcache_entry *resp;	/* cached response being sent */
+	struct httphdr_response hdr;
+	struct iovec iov[HTTP_HDR_IOVMAX + 2];	/* header, or cached response */
+	int iovpos, iovcnt;	/* unsent part of iov */
+	off_t off, size;	/* next file offset to send, file size */
+	int pipe[2];		/* splice fallback when sendfile can't be used */
+	size_t piped;		/* file bytes sitting in the pipe */
+	size_t rlen;		/* bytes in rbuf */
+	long start;		/* when the request began to arrive, in us */
+	char *body;		/* generated body being sent (/metrics) */
+	/* io_uring engine only */
+	struct msghdr msg;	/* sendmsg of the unsent part of iov */
+	char *wbuf;		/* file data on its way to the socket */
+	size_t wlen, wsent;	/* bytes read into wbuf, bytes of them sent */
+	int writing;		/* response requests in flight */
+	int recving;		/* multishot recv armed */
+	int eof;		/* the client has shut down its side */
+	int shut;		/* we shut the socket down to abort requests */
+	int overrun;		/* input dropped for lack of room in rbuf */
+	char rbuf[BUFSIZ];
+};
 
 void err_log(const char *errlog);
-static void http_request_handler(int connfd);
+static enum conn_state http_request_handler(struct conn *c);
 static int tcp_listen(void);
 static void sig_chld(int signo);
 static void daemonize(int nochdir, int noclose, const char *cmd);
+static void fork_loop(int listenfd);
+static void event_loop(int listenfd);
+static int uring_loop(int listenfd);
+static void serve(int listenfd);
+static void worker_pool(int nworkers);
+static int ncpus(void);
+
+static int keepalive_timeout = 5;	/* seconds a connection may idle */
+static int keepalive_requests = 100;	/* requests per connection */
+static size_t rcache_budget = 32 << 20;	/* bytes of rendered responses */
+static int use_uring = 1;		/* io_uring engine if the kernel has it */
 
+/*
+ * usage: server [-f] [-n] [-w workers] [-t timeout] [-r requests]
+ *   -f  fork a process per connection instead of running the epoll loop
+ *   -n  stay in the foreground (keeps the working directory)
+ *   -w  number of event loop workers, one per CPU by default; 0 runs the
+ *       event loop in the main process without supervision
+ *   -t  keep-alive idle timeout in seconds
+ *   -r  maximum number of requests served on one connection
+ *   -c  megabytes of small files kept as rendered responses, per worker
+ *   -e  I/O engine of the event loop: uring (default, falls back to epoll
+ *       when the kernel can't) or epoll
+ *
+ * GET /metrics is answered with the counters of all workers in the
+ * Prometheus text format, whatever is under www/.
+ */
 int main(int argc, char *argv[])
 {
-	int fd, connfd;
+	int opt, use_fork, nodaemon, nworkers;
 
-	daemonize(0, 0, argv[0]);
-
-	fd = tcp_listen();
-	signal(SIGCHLD, sig_chld);
-	for (;;) {
-		connfd = accept(fd, NULL, NULL);
-		if (connfd == -1)
-			err_log("accept");
-		if (fork() == 0) {
-			close(fd);
-			syslog(LOG_INFO, "A connection from client\n");
-			http_request_handler(connfd);
-			exit(EXIT_SUCCESS);
+	use_fork = nodaemon = 0;
+	nworkers = -1;
+	while ((opt = getopt(argc, argv, "fnw:t:r:c:e:")) != -1) {
+		switch (opt) {
+		case 'f':
+			use_fork = 1;
+			break;
+		case 'n':
+			nodaemon = 1;
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		case 't':
+			keepalive_timeout = atoi(optarg);
+			break;
+		case 'r':
+			keepalive_requests = atoi(optarg);
+			break;
+		case 'c':
+			rcache_budget = (size_t) atoi(optarg) << 20;
+			break;
+		case 'e':
+			if (strcmp(optarg, "uring") == 0) {
+				use_uring = 1;
+				break;
+			} else if (strcmp(optarg, "epoll") == 0) {
+				use_uring = 0;
+				break;
+			}
+			/* fall through */
+		default:
+			fprintf(stderr, "Usage: %s [-f] [-n] [-w workers] "
+				"[-t timeout] [-r requests] [-c cache_mb] "
+				"[-e uring|epoll]\n", argv[0]);
+			exit(EXIT_FAILURE);
 		}
-		close(connfd);
 	}
+	if (nworkers < 0)
+		nworkers = ncpus();
+
+	init_http_hdr_response(keepalive_timeout);
+
+	if (nodaemon)
+		openlog(argv[0], LOG_PID | LOG_PERROR, LOG_DAEMON);
+	else
+		daemonize(0, 0, argv[0]);
+
+	/* a slot per worker; connection processes all share one */
+	if (metrics_init(use_fork || nworkers == 0 ? 1 : nworkers,
+			 use_fork) == -1)
+		syslog(LOG_WARNING, "metrics only per process: %m");
+
+	if (use_fork)
+		fork_loop(tcp_listen());
+	else if (nworkers == 0)
+		serve(tcp_listen());
+	else
+		worker_pool(nworkers);
 	return 0;
 }
 
@@ -57,56 +190,1026 @@ static int tcp_listen(void)
 		err_log("listenfd error");
 	if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
 		err_log("bind error");
-	if (listen(listenfd, 10) == -1)
+	if (listen(listenfd, SOMAXCONN) == -1)
 		err_log("listen error");
 	return listenfd;
 }
 
-static void http_request_handler(int connfd)
+static void conn_init(struct conn *c, int fd)
+{
+	c->idle.prev = c->idle.next = &c->idle;
+	c->last = 0;
+	c->fd = fd;
+	c->file = NULL;
+	c->state = CONN_READ;
+	c->keepalive = 0;
+	c->nreq = 0;
+	http_request_init(&c->req);
+	c->resp = NULL;
+	c->iovpos = c->iovcnt = 0;
+	c->off = c->size = 0;
+	c->pipe[0] = c->pipe[1] = -1;
+	c->piped = 0;
+	c->rlen = 0;
+	c->start = 0;
+	c->body = NULL;
+	c->wbuf = NULL;
+	c->wlen = c->wsent = 0;
+	c->writing = c->recving = c->eof = c->shut = c->overrun = 0;
+	metrics_accepted();
+}
+
+static void idle_remove(struct conn *c)
+{
+	c->idle.prev->next = c->idle.next;
+	c->idle.next->prev = c->idle.prev;
+	c->idle.prev = c->idle.next = &c->idle;
+}
+
+static void conn_close(struct conn *c)
+{
+	idle_remove(c);
+	free(c->wbuf);
+	free(c->body);
+	if (c->resp)
+		rcache_put(c->resp);
+	if (c->file)
+		fcache_put(c->file);
+	if (c->pipe[0] != -1) {
+		close(c->pipe[0]);
+		close(c->pipe[1]);
+	}
+	close(c->fd);
+	metrics_closed();
+}
+
+/*
+ * Move the next part of the file to the socket without copying it
+ * through user space: sendfile(2), or splice(2) through a pipe when
+ * sendfile refuses the pair. Returns bytes queued on the socket.
+ */
+static ssize_t send_file(struct conn *c)
 {
-	char buf[BUFSIZ], *response;
 	ssize_t n;
-	int fd;
 
-	n = read(connfd, buf, sizeof(buf));
-	if (n == -1)
-		err_log("read error");
-	
-	response = "Accept-Ranges: bytes \
-Cache-Control: max-age=86400 \
-Connection: Keep-Alive \
-Content-Encoding: gzip \
-Content-Language: en \
-Content-Length: 4647 \
-Content-Location: index.en.html \
-Content-Type: text/html \
-Date: Thu, 26 Feb 2015 05:07:49 GMT \
-Etag: \"3b22-50ff1fb6839c0\" \
-Expires: Fri, 27 Feb 2015 05:07:49 GMT \
-Keep-Alive: timeout=5, max=100 \
-Last-Modified: Wed, 25 Feb 2015 23:27:43 GMT \
-Server: Apache \
-TCN: choice \
-Vary: negotiate,accept-language,Accept-Encoding \
-";
-
-	write(connfd, response, strlen(response));
-
-	fd = read_http_hdr_request(buf);
-	while ((n = read(fd, buf, sizeof(buf))) > 0) 
-		write(connfd, buf, n);
-	close(fd);
+	if (c->pipe[0] == -1) {
+		n = sendfile(c->fd, c->file->fd, &c->off, c->size - c->off);
+		if (n > 0)
+			metrics_sent(n);
+		if (n != -1 || (errno != EINVAL && errno != ENOSYS))
+			return n;
+		if (pipe2(c->pipe, O_NONBLOCK) == -1)
+			return -1;
+	}
+	if (c->piped == 0) {
+		n = splice(c->file->fd, &c->off, c->pipe[1], NULL,
+			   c->size - c->off, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n <= 0)
+			return n;
+		c->piped = n;
+	}
+	n = splice(c->pipe[0], NULL, c->fd, NULL, c->piped,
+		   SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+	if (n > 0) {
+		c->piped -= n;
+		metrics_sent(n);
+	}
+	return n;
+}
+
+/*
+ * Set up the response for the request just parsed. A cached response
+ * goes out whole from iov, with the Date and Connection lines spliced in
+ * after its fixed header lines; otherwise iov holds the header and the
+ * file follows with sendfile. HEAD gets the same header and no body.
+ */
+static void build_response(struct conn *c, int status)
+{
+	struct rcache_entry *r = NULL;
+	int n;
+
+	fill_http_hdr_response(&c->hdr, status, c->size, c->file,
+			       c->keepalive);
+	if (status == 200) {
+		r = rcache_get(c->file);
+		metrics_rcache(rcache_stats());
+	}
+	if (status == 200 && r != NULL) {
+		c->resp = r;
+		c->off = c->size;	/* the body is in r */
+		c->iov[0].iov_base = r->data;
+		c->iov[0].iov_len = r->hdrlen;
+		n = 1 + build_http_hdr_response(&c->hdr, c->iov + 1, HDR_VARY);
+		c->iov[n].iov_base = r->data + r->hdrlen;
+		/* the empty line, and the body unless it's HEAD */
+		c->iov[n].iov_len = c->req.head ? 2 : r->len - r->hdrlen;
+		c->iovcnt = n + 1;
+	} else {
+		c->iovcnt = build_http_hdr_response(&c->hdr, c->iov,
+						    HDR_FIXED | HDR_VARY |
+						    HDR_END);
+		if (c->req.head)
+			c->off = c->size;
+	}
+	c->iovpos = 0;
+	c->state = CONN_WRITE_HDR;
+}
+
+/* GET /metrics: the counters of all workers, instead of a file */
+static void metrics_response(struct conn *c)
+{
+	size_t len;
+	int n;
+
+	if (c->file) {
+		fcache_put(c->file);
+		c->file = NULL;
+	}
+	c->size = 0;
+	if ((c->body = malloc(METRICS_MAXBODY)) == NULL) {
+		syslog(LOG_ERR, "malloc: %m");
+		metrics_request(500);
+		build_response(c, 500);
+		return;
+	}
+	metrics_request(200);
+	len = metrics_render(c->body, METRICS_MAXBODY);
+	fill_http_hdr_response(&c->hdr, 200, len, NULL, c->keepalive);
+	c->hdr.content_type = "Content-Type: text/plain; version=0.0.4\r\n";
+	n = build_http_hdr_response(&c->hdr, c->iov,
+				    HDR_FIXED | HDR_VARY | HDR_END);
+	c->iov[n].iov_base = c->body;
+	c->iov[n].iov_len = len;
+	c->iovcnt = c->req.head ? n : n + 1;
+	c->iovpos = 0;
+	c->state = CONN_WRITE_HDR;
+}
+
+/* a request has been parsed, or rejected with status: answer it */
+static void start_response(struct conn *c, int status)
+{
+	/*
+	 * After a rejected request we can't find the next one, nor after
+	 * input that didn't fit in rbuf was dropped.
+	 */
+	c->keepalive = c->req.keepalive && (status == 200 || status == 404) &&
+		!c->overrun && ++c->nreq < keepalive_requests;
+	c->off = 0;
+	if ((status == 200 || status == 404) && c->req.target.len == 8 &&
+	    memcmp(c->rbuf + c->req.target.off, "/metrics", 8) == 0) {
+		metrics_response(c);
+		return;
+	}
+	metrics_request(status);
+	c->size = c->file ? c->file->size : 0;
+	build_response(c, status);
+}
+
+/* n bytes of iov went out */
+static void iov_advance(struct conn *c, size_t n)
+{
+	struct iovec *v;
+
+	for (; n > 0; n -= v->iov_len) {
+		v = &c->iov[c->iovpos];
+		if (n < v->iov_len) {
+			v->iov_base = (char *) v->iov_base + n;
+			v->iov_len -= n;
+			break;
+		}
+		c->iovpos++;
+	}
+}
+
+/* send what is left of iov; returns bytes sent */
+static ssize_t send_iov(struct conn *c)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = c->iov + c->iovpos;
+	msg.msg_iovlen = c->iovcnt - c->iovpos;
+	/* MSG_MORE: let the body start in the same segment */
+	n = sendmsg(c->fd, &msg, c->off < c->size ? MSG_MORE : 0);
+	if (n > 0) {
+		iov_advance(c, n);
+		metrics_sent(n);
+	}
+	return n;
+}
+
+/* response sent: drop its request and go on with the next one, if any */
+static void finish_response(struct conn *c)
+{
+	long t = metrics_now();
+
+	metrics_latency(t - c->start);
+	free(c->body);
+	c->body = NULL;
+	if (c->resp) {
+		rcache_put(c->resp);
+		c->resp = NULL;
+	}
+	if (c->file) {
+		fcache_put(c->file);
+		c->file = NULL;
+	}
+	c->wlen = c->wsent = 0;
+	c->rlen -= c->req.hdrlen;
+	memmove(c->rbuf, c->rbuf + c->req.hdrlen, c->rlen);
+	if (c->rlen > 0)
+		c->start = t;	/* a pipelined request, its turn starts now */
+	http_request_init(&c->req);
+	if (c->keepalive) {
+		c->state = CONN_READ;
+	} else {
+		/*
+		 * Closing with unread input would reset the connection and
+		 * could destroy the response before the client reads it, so
+		 * send our FIN and wait for the client's.
+		 */
+		shutdown(c->fd, SHUT_WR);
+		c->state = CONN_LINGER;
+	}
+}
+
+/*
+ * Advance the connection as far as the socket allows. Works the same on
+ * a blocking socket (fork model) and a non-blocking one (event loop):
+ * EAGAIN just returns the current state so the caller can wait for the
+ * next readiness event. Pipelined requests already sitting in rbuf are
+ * answered one after another, in order, before reading again.
+ */
+static enum conn_state http_request_handler(struct conn *c)
+{
+	ssize_t n;
+	int status;
+
+	for (;;) {
+		switch (c->state) {
+		case CONN_READ:
+			status = HTTP_AGAIN;
+			if (c->rlen > 0)
+				status = read_http_hdr_request(&c->req, c->rbuf,
+							       c->rlen,
+							       &c->file);
+			if (status == HTTP_AGAIN) {
+				if (c->rlen == sizeof(c->rbuf))
+					return c->state = CONN_CLOSE;
+				n = read(c->fd, c->rbuf + c->rlen,
+					 sizeof(c->rbuf) - c->rlen);
+				if (n == -1 &&
+				    (errno == EAGAIN || errno == EINTR))
+					return c->state;
+				if (n <= 0)
+					return c->state = CONN_CLOSE;
+				if (c->rlen == 0)
+					c->start = metrics_now();
+				c->rlen += n;
+				break;
+			}
+			start_response(c, status);
+			break;
+		case CONN_WRITE_HDR:
+			n = send_iov(c);
+			if (n == -1 && (errno == EAGAIN || errno == EINTR))
+				return c->state;
+			if (n == -1)
+				return c->state = CONN_CLOSE;
+			if (c->iovpos == c->iovcnt)
+				c->state = CONN_WRITE_BODY;
+			break;
+		case CONN_WRITE_BODY:
+			if (c->off == c->size && c->piped == 0) {
+				finish_response(c);
+				break;
+			}
+			n = send_file(c);
+			if (n == -1 && (errno == EAGAIN || errno == EINTR))
+				return c->state;
+			if (n <= 0)	/* error, or the file shrank */
+				return c->state = CONN_CLOSE;
+			break;
+		case CONN_LINGER:
+			n = read(c->fd, c->rbuf, sizeof(c->rbuf));
+			if (n == -1 && (errno == EAGAIN || errno == EINTR))
+				return c->state;
+			if (n <= 0)
+				return c->state = CONN_CLOSE;
+			break;
+		case CONN_CLOSE:
+			return c->state;
+		}
+	}
+}
+
+static void fork_loop(int listenfd)
+{
+	struct timeval tv;
+	struct conn c;
+	int connfd;
+
+	signal(SIGCHLD, sig_chld);
+	for (;;) {
+		connfd = accept(listenfd, NULL, NULL);
+		if (connfd == -1) {
+			if (errno == EINTR)
+				continue;
+			err_log("accept");
+		}
+		if (fork() == 0) {
+			close(listenfd);
+			/* blocking socket: EAGAIN here means the idle timeout hit */
+			tv.tv_sec = keepalive_timeout;
+			tv.tv_usec = 0;
+			setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO,
+				   &tv, sizeof(tv));
+			setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO,
+				   &tv, sizeof(tv));
+			conn_init(&c, connfd);
+			http_request_handler(&c);
+			conn_close(&c);
+			exit(EXIT_SUCCESS);
+		}
+		close(connfd);
+	}
+}
+
+/*
+ * Connections of the event loop, least recently active first. Touching a
+ * connection moves it to the tail, so idle ones are found at the head.
+ */
+static struct link idle_list = { &idle_list, &idle_list };
+static time_t now;
+
+static void idle_touch(struct conn *c)
+{
+	c->last = now;
+	c->idle.prev->next = c->idle.next;
+	c->idle.next->prev = c->idle.prev;
+	c->idle.prev = idle_list.prev;
+	c->idle.next = &idle_list;
+	idle_list.prev->next = &c->idle;
+	idle_list.prev = &c->idle;
+}
+
+/*
+ * Hand connections that made no progress for keepalive_timeout seconds
+ * to expire(), which must take them off the idle list.
+ */
+static void idle_expire(void (*expire)(struct conn *))
+{
+	struct conn *c;
+
+	while (idle_list.next != &idle_list) {
+		c = (struct conn *) idle_list.next;
+		if (now - c->last < keepalive_timeout)
+			break;
+		expire(c);
+	}
+}
+
+static void conn_free(struct conn *c)
+{
+	conn_close(c);
+	free(c);
+}
+
+/* accept everything pending on the (edge-triggered) listening socket */
+static void accept_all(int epfd, int listenfd)
+{
+	struct epoll_event ev;
+	struct conn *c;
+	int connfd;
+
+	for (;;) {
+		connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+		if (connfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN)
+				syslog(LOG_ERR, "accept: %m");
+			return;
+		}
+		c = malloc(sizeof(*c));
+		if (c == NULL) {
+			syslog(LOG_ERR, "malloc: %m");
+			close(connfd);
+			continue;
+		}
+		conn_init(c, connfd);
+		idle_touch(c);
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) == -1) {
+			syslog(LOG_ERR, "epoll_ctl: %m");
+			conn_free(c);
+		}
+	}
+}
+
+/* a single process multiplexing every connection over edge-triggered epoll */
+static void event_loop(int listenfd)
+{
+	static char watch_tag;	/* marks the open file cache's inotify fd */
+	struct epoll_event ev, events[MAXEVENTS];
+	struct conn *c;
+	int epfd, i, n;
+
+	signal(SIGPIPE, SIG_IGN);
+	now = time(NULL);
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+	if ((epfd = epoll_create1(0)) == -1)
+		err_log("epoll_create1");
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;	/* NULL marks the listening socket */
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1)
+		err_log("epoll_ctl");
+	if (fcache_init(FCACHE_ENTRIES) == -1) {
+		syslog(LOG_WARNING, "open file cache disabled: %m");
+	} else {
+		rcache_init(rcache_budget, RCACHE_MAXOBJ);
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &watch_tag;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fcache_watchfd(), &ev) == -1)
+			err_log("epoll_ctl");
+	}
+
+	for (;;) {
+		n = epoll_wait(epfd, events, MAXEVENTS,
+			       idle_list.next != &idle_list ? 1000 : -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err_log("epoll_wait");
+		}
+		now = time(NULL);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &watch_tag) {
+				fcache_invalidate();
+				continue;
+			}
+			c = events[i].data.ptr;
+			if (c == NULL) {
+				accept_all(epfd, listenfd);
+				continue;
+			}
+			if ((events[i].events & EPOLLERR) ||
+			    http_request_handler(c) == CONN_CLOSE) {
+				conn_free(c);	/* also drops it from epfd */
+				continue;
+			}
+			idle_touch(c);
+		}
+		idle_expire(conn_free);
+	}
+}
+
+/*
+ * io_uring engine. The same connection states as the epoll loop, but
+ * driven by completions instead of readiness: one multishot accept for
+ * the listening socket, one multishot recv per connection that takes its
+ * buffers from a shared provided buffer ring, and each response queued
+ * as a linked chain (sendmsg of the header, then read of the file into
+ * wbuf, then send of wbuf), so a GET usually costs a single
+ * io_uring_enter() that also waits for the next completions.
+ */
+static struct uring ring;
+static struct uring_bufs rbufs;
+
+/* what a completion is for, in the low bits of its user_data */
+enum {
+	UD_RECV,		/* these carry the conn */
+	UD_SENDMSG,
+	UD_READ,
+	UD_SEND,
+	UD_ACCEPT,		/* and these no pointer at all */
+	UD_WATCH,
+	UD_TICK,
+	UD_PROBE,
+};
+#define UD_MASK 7UL
+
+static struct io_uring_sqe *uring_prep(int op, int fd, const void *addr,
+				       unsigned len, off_t off, void *ptr,
+				       int tag)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(&ring)) == NULL)
+		err_log("io_uring_enter");
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = (uintptr_t) ptr | tag;
+	return sqe;
+}
+
+static void uring_accept(int listenfd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_prep(IORING_OP_ACCEPT, listenfd, NULL, 0, 0, NULL,
+			 UD_ACCEPT);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+}
+
+static void uring_recv(int fd, void *ptr, int tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_prep(IORING_OP_RECV, fd, NULL, 0, 0, ptr, tag);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = rbufs.bgid;
+}
+
+/* once a second, for the idle timeout */
+static void uring_tick(void)
+{
+	static struct __kernel_timespec ts = { 1, 0 };
+
+	uring_prep(IORING_OP_TIMEOUT, -1, &ts, 1, 0, NULL, UD_TICK);
+}
+
+static void uring_watch(int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_prep(IORING_OP_POLL_ADD, fd, NULL, IORING_POLL_ADD_MULTI,
+			 0, NULL, UD_WATCH);
+	sqe->poll32_events = POLLIN;
+}
+
+/*
+ * Queue the next part of the response; nothing of it may be in flight.
+ * MSG_WAITALL makes a short send fail the link, so file data is never
+ * sent ahead of a header that is still partly unsent.
+ */
+static void uring_send_response(struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+	int more;
+	size_t n;
+
+	/* before anything is queued: a link must not be left open */
+	if (c->off < c->size && c->wbuf == NULL &&
+	    (c->wbuf = malloc(URING_WBUFSIZE)) == NULL) {
+		syslog(LOG_ERR, "malloc: %m");
+		c->state = CONN_CLOSE;
+		return;
+	}
+	if (c->iovpos < c->iovcnt) {
+		memset(&c->msg, 0, sizeof(c->msg));
+		c->msg.msg_iov = c->iov + c->iovpos;
+		c->msg.msg_iovlen = c->iovcnt - c->iovpos;
+		more = c->off < c->size || c->wsent < c->wlen;
+		sqe = uring_prep(IORING_OP_SENDMSG, c->fd, &c->msg, 1, 0, c,
+				 UD_SENDMSG);
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL |
+			(more ? MSG_MORE : 0);
+		c->writing++;
+		if (!more)
+			return;
+		sqe->flags = IOSQE_IO_LINK;
+	}
+	if (c->wsent < c->wlen) {
+		/* what a short send or a broken link left in wbuf */
+		sqe = uring_prep(IORING_OP_SEND, c->fd, c->wbuf + c->wsent,
+				 c->wlen - c->wsent, 0, c, UD_SEND);
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL |
+			(c->off < c->size ? MSG_MORE : 0);
+		c->writing++;
+		return;
+	}
+	n = c->size - c->off;
+	if (n > URING_WBUFSIZE)
+		n = URING_WBUFSIZE;
+	/* a short read fails the link, the send then gets -ECANCELED */
+	sqe = uring_prep(IORING_OP_READ, c->file->fd, c->wbuf, n, c->off, c,
+			 UD_READ);
+	sqe->flags = IOSQE_IO_LINK;
+	sqe = uring_prep(IORING_OP_SEND, c->fd, c->wbuf, n, 0, c, UD_SEND);
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL |
+		(c->off + n < c->size ? MSG_MORE : 0);
+	c->writing += 2;
+}
+
+/*
+ * Answer what has arrived: the state machine of http_request_handler(),
+ * except that I/O is queued rather than done and results come back as
+ * completions. Runs only while nothing of the response is in flight.
+ */
+static void uring_advance(struct conn *c)
+{
+	int status;
+
+	while (c->writing == 0) {
+		switch (c->state) {
+		case CONN_READ:
+			status = HTTP_AGAIN;
+			if (c->rlen > 0)
+				status = read_http_hdr_request(&c->req, c->rbuf,
+							       c->rlen,
+							       &c->file);
+			if (status == HTTP_AGAIN) {
+				if (c->rlen == sizeof(c->rbuf) || c->eof)
+					c->state = CONN_CLOSE;
+				return;
+			}
+			start_response(c, status);
+			break;
+		case CONN_WRITE_HDR:
+		case CONN_WRITE_BODY:
+			if (c->iovpos < c->iovcnt || c->wsent < c->wlen ||
+			    c->off < c->size) {
+				uring_send_response(c);
+				if (c->state == CONN_CLOSE)
+					return;
+				break;
+			}
+			finish_response(c);
+			break;
+		case CONN_LINGER:
+			if (c->eof)
+				c->state = CONN_CLOSE;
+			return;
+		case CONN_CLOSE:
+			return;
+		}
+	}
+}
+
+/*
+ * Free a closed connection once the kernel is done with it. Shutting the
+ * socket down completes the recv and any send still waiting on it.
+ */
+static void uring_release(struct conn *c)
+{
+	if (c->recving || c->writing) {
+		idle_remove(c);
+		if (!c->shut) {
+			shutdown(c->fd, SHUT_RDWR);
+			c->shut = 1;
+		}
+		return;
+	}
+	conn_close(c);
+	free(c);
+}
+
+static void uring_expire(struct conn *c)
+{
+	c->state = CONN_CLOSE;
+	uring_release(c);
+}
+
+/* a completion for connection c */
+static void uring_complete(struct conn *c, int tag, int res, unsigned flags)
+{
+	unsigned bid;
+
+	switch (tag) {
+	case UD_RECV:
+		if (!(flags & IORING_CQE_F_MORE))
+			c->recving = 0;
+		if (res > 0) {
+			bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (c->state == CONN_LINGER || c->state == CONN_CLOSE ||
+			    (c->state != CONN_READ && !c->keepalive))
+				;	/* drained, the connection is ending */
+			else {
+				/*
+				 * The recv can't be held back like a read, so
+				 * what doesn't fit is dropped; the parser
+				 * rejects a header that fills rbuf, anything
+				 * else ends the connection after its response.
+				 */
+				if (res > sizeof(c->rbuf) - c->rlen) {
+					res = sizeof(c->rbuf) - c->rlen;
+					c->overrun = 1;
+					c->keepalive = 0;
+				}
+				if (c->rlen == 0)
+					c->start = metrics_now();
+				memcpy(c->rbuf + c->rlen,
+				       uring_buf(&rbufs, bid), res);
+				c->rlen += res;
+			}
+			uring_bufs_recycle(&rbufs, bid);
+		} else if (res == 0) {
+			c->eof = 1;
+		} else if (res != -ENOBUFS) {
+			c->state = CONN_CLOSE;
+		}
+		if (!c->recving && !c->eof && c->state != CONN_CLOSE) {
+			uring_recv(c->fd, c, UD_RECV);
+			c->recving = 1;
+		}
+		break;
+	case UD_SENDMSG:
+		c->writing--;
+		if (res > 0) {
+			iov_advance(c, res);
+			metrics_sent(res);
+		} else if (res != -ECANCELED)
+			c->state = CONN_CLOSE;
+		break;
+	case UD_READ:
+		c->writing--;
+		if (res > 0) {
+			c->wlen = res;
+			c->wsent = 0;
+			c->off += res;
+		} else if (res != -ECANCELED) {
+			c->state = CONN_CLOSE;	/* error, or the file shrank */
+		}
+		break;
+	case UD_SEND:
+		c->writing--;
+		if (res > 0) {
+			c->wsent += res;
+			metrics_sent(res);
+		} else if (res != -ECANCELED)
+			c->state = CONN_CLOSE;
+		break;
+	}
+	if (c->state != CONN_CLOSE)
+		uring_advance(c);
+	if (c->state == CONN_CLOSE)
+		uring_release(c);
+	else
+		idle_touch(c);
+}
+
+static void uring_accepted(int fd)
+{
+	struct conn *c;
+
+	if ((c = malloc(sizeof(*c))) == NULL) {
+		syslog(LOG_ERR, "malloc: %m");
+		close(fd);
+		return;
+	}
+	conn_init(c, fd);
+	idle_touch(c);
+	uring_recv(fd, c, UD_RECV);
+	c->recving = 1;
+}
+
+/* wait for the next completion, copy it to *res and take it off the ring */
+static void uring_wait(struct io_uring_cqe *res)
+{
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_cqe(&ring)) == NULL)
+		if (uring_submit(&ring, 1) == -1 && errno != EINTR)
+			err_log("io_uring_enter");
+	*res = *cqe;
+	uring_cqe_seen(&ring);
+}
+
+/*
+ * Check that the kernel does what we rely on before committing to the
+ * ring: a multishot recv from the buffer ring on a socketpair, and a
+ * multishot accept, which a kernel without it rejects right away.
+ */
+static int uring_probe(int listenfd)
+{
+	struct io_uring_cqe cqe, *next;
+	int sv[2], ok;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		return -1;
+	uring_recv(sv[0], NULL, UD_PROBE);
+	ok = write(sv[1], "", 1) == 1;
+	uring_wait(&cqe);
+	ok = ok && cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE);
+	if (cqe.res > 0)
+		uring_bufs_recycle(&rbufs, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+	close(sv[1]);
+	while (cqe.flags & IORING_CQE_F_MORE)	/* until the recv ends */
+		uring_wait(&cqe);
+	close(sv[0]);
+	if (!ok) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* a connection already waiting is left for the loop to pick up */
+	uring_accept(listenfd);
+	uring_submit(&ring, 0);
+	next = uring_cqe(&ring);
+	if (next && (next->user_data & UD_MASK) == UD_ACCEPT && next->res < 0 &&
+	    !(next->flags & IORING_CQE_F_MORE)) {
+		errno = -next->res;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The io_uring event loop. Returns -1 only if io_uring can't be set up,
+ * before anything was accepted, so the caller can use epoll instead.
+ */
+static int uring_loop(int listenfd)
+{
+	struct io_uring_cqe cqe;
+	int watchfd;
+
+	if (uring_init(&ring, URING_ENTRIES) == -1)
+		return -1;
+	if (uring_bufs_init(&ring, &rbufs, 0, URING_NBUFS, URING_BUFSIZE) == -1) {
+		uring_exit(&ring);
+		return -1;
+	}
+	if (uring_probe(listenfd) == -1) {
+		uring_exit(&ring);
+		uring_bufs_free(&rbufs);
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	now = time(NULL);
+	if (fcache_init(FCACHE_ENTRIES) == -1) {
+		syslog(LOG_WARNING, "open file cache disabled: %m");
+		watchfd = -1;
+	} else {
+		rcache_init(rcache_budget, RCACHE_MAXOBJ);
+		watchfd = fcache_watchfd();
+		uring_watch(watchfd);
+	}
+	uring_tick();
+
+	for (;;) {
+		uring_wait(&cqe);
+		now = time(NULL);
+		switch (cqe.user_data & UD_MASK) {
+		case UD_ACCEPT:
+			if (cqe.res >= 0)
+				uring_accepted(cqe.res);
+			else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED)
+				syslog(LOG_ERR, "accept: %s", strerror(-cqe.res));
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				uring_accept(listenfd);
+			break;
+		case UD_WATCH:
+			fcache_invalidate();
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				uring_watch(watchfd);
+			break;
+		case UD_TICK:
+			idle_expire(uring_expire);
+			uring_tick();
+			break;
+		case UD_PROBE:
+			break;
+		default:
+			uring_complete((struct conn *) (uintptr_t)
+				       (cqe.user_data & ~UD_MASK),
+				       cqe.user_data & UD_MASK, cqe.res,
+				       cqe.flags);
+			break;
+		}
+	}
+}
+
+/* run the event loop with the configured engine */
+static void serve(int listenfd)
+{
+	if (use_uring && uring_loop(listenfd) == -1)
+		syslog(LOG_NOTICE, "io_uring unavailable (%m), using epoll");
+	event_loop(listenfd);
+}
+
+/*
+ * Worker pool: every worker is a process with its own SO_REUSEPORT
+ * listening socket and event loop, pinned to one CPU, so the kernel
+ * spreads incoming connections across workers without a shared accept
+ * lock. The parent only restarts workers that die.
+ */
+static volatile sig_atomic_t pool_stop;
+
+static void sig_term(int signo)
+{
+	pool_stop = 1;
+}
+
+static int ncpus(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == -1)
+		return 1;
+	return CPU_COUNT(&set);
+}
+
+/* pin the calling process to the id'th CPU it is allowed to run on */
+static void pin_to_cpu(int id)
+{
+	cpu_set_t set;
+	int cpu, n;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == -1)
+		return;
+	id %= CPU_COUNT(&set);
+	for (cpu = 0, n = -1; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &set) && ++n == id)
+			break;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		syslog(LOG_WARNING, "sched_setaffinity: %m");
+}
+
+static pid_t spawn_worker(int id)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1) {
+		syslog(LOG_ERR, "fork: %m");
+	} else if (pid == 0) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		pin_to_cpu(id);
+		metrics_worker(id);
+		serve(tcp_listen());
+		exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static void worker_pool(int nworkers)
+{
+	struct sigaction sa;
+	pid_t *workers, pid;
+	time_t *started;
+	int i, status;
+
+	workers = calloc(nworkers, sizeof(*workers));
+	started = calloc(nworkers, sizeof(*started));
+	if (workers == NULL || started == NULL)
+		err_log("calloc");
+
+	/* no SA_RESTART, so wait() returns when we are told to stop */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_term;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	for (i = 0; i < nworkers; i++) {
+		workers[i] = spawn_worker(i);
+		started[i] = time(NULL);
+	}
+
+	while (!pool_stop) {
+		pid = wait(&status);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			err_log("wait");
+		}
+		for (i = 0; i < nworkers && workers[i] != pid; i++)
+			;
+		if (i == nworkers || pool_stop)
+			continue;
+		if (WIFSIGNALED(status))
+			syslog(LOG_WARNING, "worker %d (pid %d) killed by signal %d",
+			       i, pid, WTERMSIG(status));
+		else
+			syslog(LOG_WARNING, "worker %d (pid %d) exited with %d",
+			       i, pid, WEXITSTATUS(status));
+		/* don't spin if the worker dies right away, e.g. bind fails */
+		if (time(NULL) - started[i] < 1)
+			sleep(1);
+		workers[i] = spawn_worker(i);
+		started[i] = time(NULL);
+	}
+
+	for (i = 0; i < nworkers; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	while (wait(NULL) > 0)
+		;
+	free(workers);
+	free(started);
 }
 
 static void sig_chld(int signo)
 {
-	while (waitpid(-1, NULL, WNOHANG) != -1)
+	while (waitpid(-1, NULL, WNOHANG) > 0)
 		;
 }
 
 static void daemonize(int nochdir, int noclose, const char *cmd)
 {
-	if (daemon(0, 0) == -1) {	/* we would get here? really? */
+	if (daemon(nochdir, noclose) == -1) {	/* we would get here? really? */
 		perror("daemon error");
 		exit(EXIT_FAILURE);
 	}
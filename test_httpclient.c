@@ -0,0 +1,151 @@
+/*
+ * Regression tests for the httpclient.c response parser: canned
+ * responses are pumped through it in pieces of various sizes, and the
+ * body that reaches the sink is checked. "make check" runs them.
+ */
+#include "httpclient.h"
+
+static int failed;
+
+#define CHECK(cond, name)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s: %s: %s failed\n",		\
+				__func__, name, #cond);			\
+			failed++;					\
+		}							\
+	} while (0)
+
+/*
+ * Feed in to a fresh response step bytes at a time, as if read() had
+ * returned them, and leave the body that got to the sink in body.
+ */
+static void feed(struct http_response *r, const char *in, size_t step,
+		 char *body, size_t size)
+{
+	size_t len = strlen(in), n;
+	FILE *fp;
+	ssize_t got;
+
+	if ((fp = tmpfile()) == NULL)
+		err_sys("tmpfile");
+	http_response_init(r);
+	r->trace = NULL;
+	http_response_sink(r, fileno(fp));
+	for (; len > 0; in += n, len -= n) {
+		n = len < step ? len : step;
+		pump(r, in, n);
+	}
+	got = pread(fileno(fp), body, size - 1, 0);
+	body[got > 0 ? got : 0] = '\0';
+	fclose(fp);
+}
+
+/*
+ * pump() used to count the byte after each piece of body as used while
+ * looking for a newline, so the chunk framing lost a byte and a chunked
+ * response that arrived in one read never completed.
+ */
+static void test_chunked(void)
+{
+	static const char in[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"\r\n"
+		"5\r\nhello\r\n"
+		"6\r\n world\r\n"
+		"0\r\n"
+		"\r\n";
+	static const size_t steps[] = { sizeof(in), 7, 1 };
+	struct http_response r;
+	char body[64], name[32];
+	int i;
+
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		snprintf(name, sizeof(name), "step %zu", steps[i]);
+		feed(&r, in, steps[i], body, sizeof(body));
+		CHECK(http_response_done(&r), name);
+		CHECK(strcmp(body, "hello world") == 0, name);
+		http_response_free(&r);
+	}
+}
+
+static void test_content_length(void)
+{
+	static const char in[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Length: 5\r\n"
+		"\r\n"
+		"hello";
+	struct http_response r;
+	char body[64];
+
+	feed(&r, in, sizeof(in), body, sizeof(body));
+	CHECK(http_response_done(&r), "whole");
+	CHECK(r.status == 200, "whole");
+	CHECK(strcmp(body, "hello") == 0, "whole");
+	http_response_free(&r);
+}
+
+/* 1xx, 204 and 304 have no body, whatever their headers say */
+static void test_no_body(void)
+{
+	static const char *const in[] = {
+		"HTTP/1.1 204 No Content\r\n\r\n",
+		"HTTP/1.1 304 Not Modified\r\nETag: \"x\"\r\n\r\n",
+	};
+	struct http_response r;
+	char body[64];
+	int i;
+
+	for (i = 0; i < sizeof(in) / sizeof(in[0]); i++) {
+		feed(&r, in[i], strlen(in[i]), body, sizeof(body));
+		CHECK(http_response_done(&r), in[i]);
+		CHECK(body[0] == '\0', in[i]);
+		http_response_free(&r);
+	}
+}
+
+/* without Content-Length or chunked, the body ends when the server closes */
+static void test_until_close(void)
+{
+	static const char in[] = "HTTP/1.0 200 OK\r\n\r\nuntil close";
+	struct http_response r;
+	char body[64];
+	ssize_t n;
+	FILE *fp;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err_sys("socketpair");
+	if ((fp = tmpfile()) == NULL)
+		err_sys("tmpfile");
+	http_response_init(&r);
+	r.trace = NULL;
+	http_response_sink(&r, fileno(fp));
+	if (write(sv[1], in, strlen(in)) != strlen(in))
+		err_sys("write");
+	close(sv[1]);
+	while ((n = http_response_read(&r, sv[0])) > 0)
+		CHECK(!http_response_done(&r), "before close");
+	CHECK(n == 0, "close");
+	CHECK(http_response_done(&r), "close");
+	n = pread(fileno(fp), body, sizeof(body) - 1, 0);
+	body[n > 0 ? n : 0] = '\0';
+	CHECK(strcmp(body, "until close") == 0, "close");
+	fclose(fp);
+	close(sv[0]);
+	http_response_free(&r);
+}
+
+int main(void)
+{
+	test_chunked();
+	test_content_length();
+	test_no_body();
+	test_until_close();
+	if (failed)
+		return EXIT_FAILURE;
+	printf("test_httpclient: ok\n");
+	return 0;
+}
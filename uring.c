@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* the kernel reads the SQ tail and writes the CQ tail concurrently */
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+		     unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/*
+ * Set up a ring with room for entries submissions and four times as many
+ * completions, multishot requests produce more than one each. Returns -1
+ * with errno set if the kernel has no (usable) io_uring.
+ */
+int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	unsigned i;
+
+	memset(&p, 0, sizeof(p));
+	/* one thread submits, and nothing needs completions run early */
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+		IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = entries * 4;
+	if ((r->fd = sys_setup(entries, &p)) == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));	/* older kernel */
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = entries * 4;
+		r->fd = sys_setup(entries, &p);
+	}
+	if (r->fd == -1)
+		return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto err_close;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_cq;
+
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	/* SQE i always sits in slot i, the indirection is not needed */
+	for (i = 0; i < p.sq_entries; i++)
+		r->sq_array[i] = i;
+	return 0;
+
+err_cq:
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+err_sq:
+	munmap(r->sq_ring, r->sq_ring_size);
+err_close:
+	close(r->fd);
+	return -1;
+}
+
+void uring_exit(struct uring *r)
+{
+	munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+/*
+ * A cleared SQE to fill in, published by the next uring_submit(). If the
+ * queue is full what is queued gets submitted first; NULL only if that
+ * fails too.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if (r->sq_local - load_acquire(r->sq_head) >= r->sq_entries) {
+		uring_submit(r, 0);
+		if (r->sq_local - load_acquire(r->sq_head) >= r->sq_entries)
+			return NULL;
+	}
+	sqe = &r->sqes[r->sq_local++ & *r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * Submit everything queued and wait for at least wait_nr completions, in
+ * one system call. Returns the number submitted or -1.
+ */
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned n = r->sq_local - *r->sq_tail;
+
+	if (n == 0 && wait_nr == 0)
+		return 0;
+	store_release(r->sq_tail, r->sq_local);
+	return sys_enter(r->fd, n, wait_nr,
+			 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/* the oldest unseen completion, or NULL */
+struct io_uring_cqe *uring_cqe(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == load_acquire(r->cq_tail))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+	store_release(r->cq_head, *r->cq_head + 1);
+}
+
+/*
+ * Register nbufs buffers of size bytes as buffer group bgid: recv with
+ * IOSQE_BUFFER_SELECT takes one when data arrives, instead of every
+ * connection pinning a buffer while it waits. nbufs must be a power of 2.
+ */
+int uring_bufs_init(struct uring *r, struct uring_bufs *b, int bgid,
+		    unsigned nbufs, unsigned size)
+{
+	struct io_uring_buf_reg reg;
+	size_t ringsize;
+	unsigned i;
+
+	ringsize = nbufs * sizeof(struct io_uring_buf);
+	b->br = mmap(NULL, ringsize, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED)
+		return -1;
+	if ((b->base = malloc((size_t) nbufs * size)) == NULL) {
+		munmap(b->br, ringsize);
+		return -1;
+	}
+	b->nbufs = nbufs;
+	b->size = size;
+	b->mask = nbufs - 1;
+	b->bgid = bgid;
+	b->tail = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) b->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		uring_bufs_free(b);
+		return -1;
+	}
+	for (i = 0; i < nbufs; i++)
+		uring_bufs_recycle(b, i);
+	return 0;
+}
+
+/* give buffer bid back to the kernel */
+void uring_bufs_recycle(struct uring_bufs *b, unsigned bid)
+{
+	struct io_uring_buf *buf = &b->br->bufs[b->tail & b->mask];
+
+	buf->addr = (unsigned long) uring_buf(b, bid);
+	buf->len = b->size;
+	buf->bid = bid;
+	store_release(&b->br->tail, ++b->tail);
+}
+
+void uring_bufs_free(struct uring_bufs *b)
+{
+	munmap(b->br, b->nbufs * sizeof(struct io_uring_buf));
+	free(b->base);
+}
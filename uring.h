@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Just enough io_uring for the server, straight on top of the system
+ * calls: one ring per event loop, plus a ring of provided buffers that
+ * recv picks its buffers from.
+ */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_local;	/* SQEs handed out but not yet published */
+	unsigned sq_entries;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+};
+
+struct uring_bufs {
+	struct io_uring_buf_ring *br;
+	char *base;		/* nbufs buffers of size bytes each */
+	unsigned nbufs, size, mask;
+	unsigned short tail;	/* next slot to hand a buffer back in */
+	int bgid;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+int uring_submit(struct uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+int uring_bufs_init(struct uring *r, struct uring_bufs *b, int bgid,
+		    unsigned nbufs, unsigned size);
+void uring_bufs_recycle(struct uring_bufs *b, unsigned bid);
+void uring_bufs_free(struct uring_bufs *b);
+
+static inline char *uring_buf(struct uring_bufs *b, unsigned bid)
+{
+	return b->base + (size_t) bid * b->size;
+}
+
+#endif